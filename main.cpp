@@ -9,8 +9,16 @@
 #include<cstring>
 #include<ctime>
 #include<cstdarg>
+#include<cassert>
 
 #include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <map>
 
 #include<unistd.h>
 #include<fcntl.h>
@@ -18,17 +26,61 @@
 
 #include<sys/ioctl.h>
 #include<sys/types.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<sys/uio.h>
+#include<sys/signalfd.h>
+#include<sys/timerfd.h>
+#include<sys/eventfd.h>
+#include<poll.h>
+#include<csignal>
+#include<climits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define SEARCH_X86 1
+#endif
 
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 #define VERSION "1.0.0"
-#define TAB_STOP 8
+#define TAB_STOP 8 // default for E.tabstop (-t)
 #define QUIT_TIMES 3
+#define INDEX_PART (4 << 20) // bytes of the mapping one loader turn scans
+#define HL_CHECKPOINT 256 // rows between saved lexer states
+#define HL_SYNC_ROWS 512 // rows the UI thread walks for a lexer state before leaving it to the highlighter
+#define HL_BATCH 1024 // rows the highlighter lexes per turn at the buffer, per core
+#define MATCH_BATCH 4096 // rows the match indexer scans per turn at the buffer
+#define MATCH_BATCH_BYTES (1 << 20) // ... or fewer, once their bytes add up to this
+#define INPUT_BUF 4096 // terminal input ring, a power of two
+#define ESC_TIMEOUT 100 // ms to wait for the rest of an escape sequence
+#define STATUS_TIMEOUT 5 // seconds a status message stays up
+#define FRAME_STALE 250 // ms after which a frame is drawn even with keys still queued
+#define LARGE_FILE_MB 1024 // files from this size on open in large-file mode (-l)
+#define LARGE_SCREENS 5 // screens of rows held around the cursor in large-file mode
+#define LARGE_VIEW (16 << 20) // bytes of the file mapped at a time in large-file mode
+#define RE_MAX_STATES 2048 // DFA states a regex caches before starting over
+#define RE_MAX_REPEAT 255 // largest count in {m,n}
+#define RE_MAX_NODES 8192 // NFA nodes per direction; nested counts past this are malformed
+#define CACHE_MB 32 // MB of render and hl kept for rows off screen (-m)
+#define POOL_CLASSES 49 // row block sizes from 16 bytes to 64 KB, four per power of two; bigger ones use malloc
+#define POOL_SLAB (1 << 20) // bytes the pool carves blocks from at a time
+
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER,
+  HL_MATCH
+};
 
 struct editorSyntax {
     char *filetype;
     char **filematch;
-    char **keywords;
+    int (*keyword)(const char *s, int len, unsigned int hash); // HL_KEYWORD1/2 or HL_NORMAL
     char *singleline_comment_start;
     char *multiline_comment_start;
     char *multiline_comment_end;
@@ -37,45 +89,129 @@ struct editorSyntax {
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
+#define HL_KEYWORDS_NOCASE (1<<2)
+
+// keyword lookup: the lexer hashes each word once (FNV-1a), and a switch on
+// the hash picks the one keyword it can be. The case labels are computed at
+// compile time, so two keywords of a language hashing alike fail to build.
+#define KW_HASH_INIT 2166136261u
+constexpr unsigned int kwStep(unsigned int h, unsigned char c) { return (h ^ c) * 16777619u; }
+constexpr unsigned int kwHash(const char *s, unsigned int h = KW_HASH_INIT) { return *s ? kwHash(s + 1, kwStep(h, *s)) : h; }
+
+#define KW_CASE(k, type) case kwHash(k): return (len == sizeof(k) - 1 && !memcmp(s, k, len)) ? type : HL_NORMAL;
+#define KW_CASE_NOCASE(k, type) case kwHash(k): return (len == sizeof(k) - 1 && !strncasecmp(s, k, len)) ? type : HL_NORMAL;
+#define KW1(k) KW_CASE(k, HL_KEYWORD1)
+#define KW2(k) KW_CASE(k, HL_KEYWORD2)
+#define KWI1(k) KW_CASE_NOCASE(k, HL_KEYWORD1)
+#define KWI2(k) KW_CASE_NOCASE(k, HL_KEYWORD2)
+#define KEYWORD_LOOKUP(name, list, kw1, kw2) \
+    int name(const char *s, int len, unsigned int hash) { \
+        switch (hash) { list(kw1, kw2) } \
+        return HL_NORMAL; \
+    }
 
-char *C_HL_extensions[] { (char*)".c", (char*)".h", (char*)".cpp", NULL };
-char *C_HL_keywords[] = {
-  (char*)"switch",
-  (char*)"if",
-  (char*)"while",
-  (char*)"for",
-  (char*)"break",
-  (char*)"continue",
-  (char*)"return",
-  (char*)"else",
-  (char*)"struct",
-  (char*)"union",
-  (char*)"typedef",
-  (char*)"static",
-  (char*)"enum",
-  (char*)"class",
-  (char*)"case",
-  (char*)"int|",
-  (char*)"long|",
-  (char*)"double|",
-  (char*)"float|",
-  (char*)"char|",
-  (char*)"unsigned|",
-  (char*)"signed|",
-  (char*)"void|",
-  NULL
-};
+char *C_HL_extensions[] { (char*)".c", (char*)".h", NULL };
+#define C_HL_KEYWORDS(K1, K2) \
+    K1("switch") K1("if") K1("while") K1("for") K1("break") K1("continue") \
+    K1("return") K1("else") K1("struct") K1("union") K1("typedef") K1("static") \
+    K1("enum") K1("class") K1("case") \
+    K2("int") K2("long") K2("double") K2("float") K2("char") K2("unsigned") \
+    K2("signed") K2("void")
+KEYWORD_LOOKUP(C_HL_keyword, C_HL_KEYWORDS, KW1, KW2)
+
+char *CPP_HL_extensions[] { (char*)".cpp", (char*)".cc", (char*)".cxx", (char*)".hpp", (char*)".hh", (char*)".hxx", NULL };
+#define CPP_HL_KEYWORDS(K1, K2) \
+    C_HL_KEYWORDS(K1, K2) \
+    K1("do") K1("goto") K1("default") K1("sizeof") K1("extern") K1("const") \
+    K1("volatile") K1("register") K1("inline") K1("namespace") K1("using") \
+    K1("template") K1("typename") K1("public") K1("private") K1("protected") \
+    K1("virtual") K1("override") K1("final") K1("friend") K1("explicit") \
+    K1("operator") K1("new") K1("delete") K1("this") K1("try") K1("catch") \
+    K1("throw") K1("noexcept") K1("constexpr") K1("decltype") K1("mutable") \
+    K1("static_assert") K1("static_cast") K1("dynamic_cast") K1("const_cast") \
+    K1("reinterpret_cast") K1("nullptr") K1("true") K1("false") K1("alignas") \
+    K1("alignof") K1("thread_local") K1("co_await") K1("co_return") K1("co_yield") \
+    K1("concept") K1("requires") K1("consteval") K1("constinit") K1("export") \
+    K1("typeid") \
+    K2("bool") K2("short") K2("auto") K2("wchar_t") K2("char8_t") K2("char16_t") \
+    K2("char32_t") K2("size_t") K2("ssize_t") K2("int8_t") K2("int16_t") \
+    K2("int32_t") K2("int64_t") K2("uint8_t") K2("uint16_t") K2("uint32_t") \
+    K2("uint64_t")
+KEYWORD_LOOKUP(CPP_HL_keyword, CPP_HL_KEYWORDS, KW1, KW2)
+
+char *RUST_HL_extensions[] { (char*)".rs", NULL };
+#define RUST_HL_KEYWORDS(K1, K2) \
+    K1("as") K1("async") K1("await") K1("break") K1("const") K1("continue") \
+    K1("crate") K1("dyn") K1("else") K1("enum") K1("extern") K1("false") \
+    K1("fn") K1("for") K1("if") K1("impl") K1("in") K1("let") K1("loop") \
+    K1("match") K1("mod") K1("move") K1("mut") K1("pub") K1("ref") \
+    K1("return") K1("self") K1("Self") K1("static") K1("struct") K1("super") \
+    K1("trait") K1("true") K1("type") K1("unsafe") K1("use") K1("where") \
+    K1("while") K1("macro_rules") K1("union") \
+    K2("i8") K2("i16") K2("i32") K2("i64") K2("i128") K2("isize") K2("u8") \
+    K2("u16") K2("u32") K2("u64") K2("u128") K2("usize") K2("f32") K2("f64") \
+    K2("bool") K2("char") K2("str") K2("String") K2("Vec") K2("Option") \
+    K2("Result") K2("Box") K2("Some") K2("None") K2("Ok") K2("Err")
+KEYWORD_LOOKUP(RUST_HL_keyword, RUST_HL_KEYWORDS, KW1, KW2)
+
+char *SQL_HL_extensions[] { (char*)".sql", NULL };
+#define SQL_HL_KEYWORDS(K1, K2) \
+    K1("select") K1("from") K1("where") K1("insert") K1("into") K1("values") \
+    K1("update") K1("set") K1("delete") K1("create") K1("drop") K1("alter") \
+    K1("table") K1("index") K1("view") K1("trigger") K1("database") K1("schema") \
+    K1("join") K1("inner") K1("left") K1("right") K1("outer") K1("full") \
+    K1("cross") K1("natural") K1("on") K1("using") K1("and") K1("or") K1("not") \
+    K1("null") K1("is") K1("in") K1("as") K1("distinct") K1("all") K1("any") \
+    K1("exists") K1("between") K1("like") K1("case") K1("when") K1("then") \
+    K1("else") K1("end") K1("group") K1("by") K1("order") K1("asc") K1("desc") \
+    K1("having") K1("limit") K1("offset") K1("union") K1("intersect") \
+    K1("except") K1("primary") K1("foreign") K1("key") K1("references") \
+    K1("default") K1("unique") K1("check") K1("constraint") K1("begin") \
+    K1("commit") K1("rollback") K1("transaction") K1("with") K1("returning") \
+    K1("if") K1("grant") K1("revoke") K1("truncate") K1("true") K1("false") \
+    K2("int") K2("integer") K2("smallint") K2("bigint") K2("decimal") \
+    K2("numeric") K2("real") K2("float") K2("double") K2("char") K2("varchar") \
+    K2("text") K2("date") K2("time") K2("timestamp") K2("interval") \
+    K2("boolean") K2("blob") K2("serial")
+KEYWORD_LOOKUP(SQL_HL_keyword, SQL_HL_KEYWORDS, KWI1, KWI2)
 
 struct editorSyntax HLDB[] = {
     {
         (char*)"c",
         C_HL_extensions,
-        C_HL_keywords,
+        C_HL_keyword,
+        (char*)"//",
+        (char*)"/*",
+        (char*)"*/",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    },
+    {
+        (char*)"c++",
+        CPP_HL_extensions,
+        CPP_HL_keyword,
+        (char*)"//",
+        (char*)"/*",
+        (char*)"*/",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    },
+    {
+        (char*)"rust",
+        RUST_HL_extensions,
+        RUST_HL_keyword,
         (char*)"//",
         (char*)"/*",
         (char*)"*/",
         HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
     },
+    {
+        (char*)"sql",
+        SQL_HL_extensions,
+        SQL_HL_keyword,
+        (char*)"--",
+        (char*)"/*",
+        (char*)"*/",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_KEYWORDS_NOCASE
+    },
 };
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
@@ -89,23 +225,244 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_KEY, // bracketed paste, text in E.in.paste
+    REFRESH_KEY // not a key: background work changed what is on screen
 };
 
 
-typedef struct erow {
-    int idx;
+typedef struct erow { // its row number is its position in E.rows: editorRowIndex
     int size;
     int rsize;
-    char *chars;
-    char *render;
-    unsigned char *hl;
-    int hl_open_comment;
+    char *chars; // at the start of block, or in the file mapping
+    char *render; // chars itself when the row has no tabs, NULL until built
+    unsigned char *hl; // NULL until the row is drawn
+    char *block; // the row's one allocation: chars, then render if it has tabs, then hl
+    int cap; // bytes of block for chars, 0 while they are mapped
+    int rcap; // bytes of block for render, and again for hl
+    int tabs; // tabs in chars when render was last laid out
+    int *tab; // per tab in chars, its column and the render column just past it
+    int ntab; // tabs indexed in tab, -1 until editorRowTabs builds it
+    int tabcap; // room in tab, in tabs
+    struct erow *lru_prev, *lru_next; // in E.cache while block has render and hl space
+    int hl_start; // lexer state hl was built from, -1 if never lexed
+    int hl_open_comment; // lexer state at the end of the row
+    int mapped; // chars points into the file mapping and is not ours to free
+    int frozen; // chars is in the snapshot of a save in flight and must not change
 } erow;
 
+typedef struct rownode { // balanced rope of rows (implicit treap ordered by position)
+    erow row; // must stay first: an erow * is also a pointer to its rownode
+    struct rownode *left;
+    struct rownode *right;
+    struct rownode *parent;
+    int count; // rows in this subtree
+    unsigned int prio; // heap priority, random
+} rownode;
+
+struct rowPool { // size classes for row blocks, carved from shared slabs and released together
+    char *free[POOL_CLASSES]; // freed blocks of each class, each holding a pointer to the next
+    std::vector<char*> slabs;
+    char *at, *end; // what is left of the newest slab
+    long long live; // bytes of the blocks in use, as rounded up to their class
+    long long held; // bytes of the slabs, and of blocks too big for a class
+    long blocks; // blocks in use
+};
+
+struct renderCache { // rows with render and hl space, most recently drawn first
+    erow *head, *tail;
+    long long bytes; // render and hl space of the rows in it
+    long long budget; // bytes left after a frame; rows on screen stay regardless (-m), -1 until set
+};
+
 struct abuf { // append buffer
     char *b;
     int len;
+    int cap;
+};
+
+#define ATTR_REVERSE 0x80
+#define DIFF_GAP 8 // unchanged cells worth rewriting rather than jumping over
+
+struct screen { // grid of cells: what the terminal shows, or the next frame
+    int rows;
+    int cols;
+    char *chars;
+    unsigned char *attrs; // SGR foreground (0 for default) | ATTR_REVERSE
+};
+
+struct indexPart { // rows of the lines starting in one INDEX_PART of the mapping
+    int built;
+    int count;
+    rownode *root; // over one block holding all its rows
+};
+
+struct lineIndex { // newline scan of the file mapping, run on every core
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<struct indexPart> parts;
+    std::atomic<size_t> claimed; // parts handed to loader threads
+    size_t (*scan)(const char *s, size_t n, size_t off, std::vector<size_t> &ends); // vector newline scan, NULL for none
+    size_t merged; // parts turned into rows (UI thread only)
+    bool done;
+    std::atomic<bool> stop;
+};
+
+struct hlJob { // one row of a highlighter batch
+    erow *row;
+    size_t off; // text copied into the batch buffer
+    int len;
+    int draw; // the row has hl, so it gets a new one
+    int start, end; // lexer states, as cached when copied and then as lexed
+    int lexed;
+    unsigned char *hl;
+};
+
+struct highlighter { // repairs lexer states below an edit on a background thread
+    std::thread thread;
+    std::condition_variable cond; // waits on E.lock
+    std::atomic<bool> stop;
+    std::atomic<int> edits; // bumped by every change to the rows, cancels the batch in flight
+    int pos, state; // next row to look at and its start state, pos -1 to start over
+    int want; // furthest row the UI gave up on
+    std::vector<struct hlJob> jobs; // the batch being lexed
+    std::vector<char> text;
+    struct editorSyntax *syntax; // of the batch
+    int batch_edits; // E.hl.edits when the batch was copied
+    std::vector<std::thread> lexers; // lex the later slices of a batch, one each
+    std::mutex lex_lock;
+    std::condition_variable lex_cond;
+    int lex_gen; // bumped for every batch handed to the lexers
+    int lex_left; // slices still being lexed
+};
+
+enum regexNodeType {
+    RE_CHAR, // one byte out of set
+    RE_SPLIT, // out1 or out2
+    RE_EMPTY,
+    RE_BOL, // start of the row
+    RE_EOL, // end of the row
+    RE_MATCH
+};
+
+struct rnode { // NFA node
+    int type;
+    int out1, out2;
+    unsigned char set[32]; // RE_CHAR: bytes it reads, one bit each
+};
+
+struct regexProgram { // the NFA of one direction and the part of its DFA built so far
+    std::vector<rnode> nodes;
+    int start;
+    int unanchored; // a match may start at any byte
+    // DFA states are sorted sets of NFA states, node * 2 + (a byte was read),
+    // led by -1 at the start of the row
+    std::map<std::vector<int>, int> ids;
+    std::vector<std::vector<int> > sets;
+    std::vector<int> next; // 256 transitions per state, -1 until taken
+    std::vector<char> accept; // a non-empty match ends here
+    std::vector<char> eol_accept; // ... or would if the row ended here
+    int start_id[2]; // start state, without and with the start of the row
+    int flushes;
+    std::vector<int> mark; // closure scratch
+    int markgen;
+};
+
+struct regex {
+    struct regexProgram fwd; // the pattern
+    struct regexProgram rev; // the pattern read backwards
+};
+
+struct regexParser {
+    const char *p;
+    int reverse; // build the pattern read backwards
+    std::vector<rnode> *nodes;
+    int error;
+};
+
+struct regexFrag { // a piece of NFA: entry node, and an RE_EMPTY exit whose out1 is unset
+    int in, out;
+};
+
+struct searcher { // a query compiled for searchFind
+    std::string needle; // the query as typed
+    int skip[256]; // Horspool shift per last byte of the window
+    int (*find)(const struct searcher *sr, const char *hay, int n); // offset of the first match, -1 if none
+    int regex; // needle is a regular expression
+    struct regex *re; // ... compiled, NULL if it is malformed
+};
+
+struct search { // Ctrl-F state while the prompt is open
+    struct searcher sr;
+    std::string query; // the query hits belong to
+    std::vector<std::vector<int> > hits; // hits[k]: rows holding the first k + 1 bytes of query
+    std::vector<std::vector<size_t> > lines; // lines[k]: where each row of hits[k] starts in the mapping, if found there
+    int match_row, match_col, match_len; // match drawn highlighted, match_row -1 for none
+    int regex; // search for regular expressions, toggled with Ctrl-R
+    char prompt[96];
+};
+
+struct matchIndex { // every match of the last search, built on a background thread
+    std::thread thread;
+    std::condition_variable cond; // waits on E.lock
+    std::atomic<bool> stop;
+    struct searcher sr; // the query, empty for no search
+    std::vector<std::pair<int, int> > hits; // (row, col) of each match, in order
+    int scanned; // rows [0, scanned) are in hits
+    std::vector<int> starts; // editorMatchRow scratch: where regex matches start in a row
+};
+
+struct overlayEntry { // lines that replace original bytes [off, off + len), off being the map key
+    size_t len;
+    std::string text; // whole lines, each ending in '\n'
+};
+
+struct largeFile { // a file too big to load: rows for a window of it, edits kept aside
+    int on;
+    int fd;
+    size_t size;
+    long long threshold; // -l, in bytes; -1 until set
+    char *view; // read-only mapping of [view_off, view_off + view_len)
+    size_t view_off, view_len;
+    size_t start, end; // original bytes the window's rows were loaded from
+    std::vector<std::string> base; // the window's rows as loaded
+    std::vector<size_t> base_off, base_end; // original range of each, the whole overlay entry for edited lines
+    int edits; // E.hl.edits when the window was loaded
+    std::map<size_t, overlayEntry> overlay; // edits that left the window, by original offset
+};
+
+struct saver { // writes a snapshot of the rows on a background thread
+    std::thread thread;
+    int active; // a save is in flight (UI thread)
+    std::atomic<bool> done;
+    std::atomic<long long> written;
+    long long total;
+    std::vector<struct iovec> segs; // the snapshot: row bytes and newlines in file order
+    std::vector<std::pair<char*, size_t> > retired; // frozen row blocks replaced since the snapshot, and their sizes
+    int large; // large-file mode: the snapshot is the overlay, over the file in in_fd
+    std::map<size_t, overlayEntry> overlay;
+    int in_fd;
+    size_t in_size;
+    std::string target, tmp;
+    mode_t mode;
+    int rows; // lines in the snapshot
+    int dirty; // E.dirty when the snapshot was taken
+    int err; // errno of the step that failed, 0 if none
+    struct timespec start;
+};
+
+struct input { // terminal bytes read ahead of the key parser
+    char ring[INPUT_BUF];
+    unsigned int head, tail; // read at head, fill at tail; free-running
+    std::string paste; // text of the last PASTE_KEY
+};
+
+struct events { // what the UI thread waits on besides the terminal
+    int wake; // eventfd, written by editorWake
+    int signal; // signalfd for SIGWINCH
+    int timer; // timerfd, fires when the status message expires
+    int winch; // the window changed size
 };
 
 struct editorConfig {
@@ -116,24 +473,47 @@ struct editorConfig {
     int screenrows;
     int screencols;
     int numrows;
-    erow *row;
+    rownode *rows;
+    std::vector<int> hl_checkpoints; // lexer state at the start of every HL_CHECKPOINT-th row
+    int hl_valid; // checkpoints that are still known to be right
+    int hl_memo_at, hl_memo_state; // last start state computed, -1 if none
+    unsigned char *hl_scratch; // hl of rows lexed only for their end state
+    int hl_scratch_size;
+    char *map; // read-only mapping of the opened file
+    size_t mapsize;
+    int map_intact; // rows are still exactly the lines of the mapping
+    struct lineIndex index;
+    rownode *free_nodes; // deleted rows, linked through right, for reuse
+    struct rowPool pool; // row blocks
+    struct renderCache cache;
+    struct highlighter hl;
+    struct search search;
+    struct matchIndex match;
+    struct largeFile large;
+    struct saver save;
+    struct input in;
+    struct events ev;
+    std::mutex lock; // the rows; held by the UI thread except while it waits for input
+    std::atomic<int> lock_wanted; // the UI thread is waiting for lock
+    std::atomic<bool> wake; // set by background threads
     int dirty;
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
     struct termios orig_termios;
-};
-
-enum editorHighlight {
-  HL_NORMAL = 0,
-  HL_COMMENT,
-  HL_MLCOMMENT,
-  HL_KEYWORD1,
-  HL_KEYWORD2,
-  HL_STRING,
-  HL_NUMBER,
-  HL_MATCH
+    struct screen screen; // what the terminal currently shows
+    struct screen frame; // the frame being drawn
+    int screen_valid; // 0 forces a full repaint
+    int screen_rowoff, screen_coloff; // scroll offsets the screen was drawn at
+    int cursor_y, cursor_x; // where the last frame left the cursor
+    int fps; // frame rate cap, 0 for none (-f)
+    int tabstop; // render columns per tab stop (-t)
+    struct timespec frame_time; // when the last frame was drawn
+    struct abuf out; // output arena, reused by every frame
+    long frames; // frames that wrote anything
+    int frame_bytes; // bytes written by the last frame
+    long long frame_total; // bytes written by all frames
 };
 
 // debug mode
@@ -153,30 +533,107 @@ struct editorConfig E;
 
 void initEditor();
 int editorReadKey();
+int editorReadEscape();
+int editorReadPaste();
+int editorInputFill(int timeout);
+int editorInputPeek(unsigned int i);
+void editorEventsInit();
+void editorEventsRead(struct pollfd *fds);
+int editorIdle();
+void editorWake();
+void editorWorkersStop();
 void editorProcessKeypress();
+void editorFrame();
+int editorInputPending();
+int editorSinceFrame();
 void editorRefreshScreen();
-void editorDrawRows(struct abuf *ab);
+void editorDrawRows(struct screen *s);
+void editorFlushScreen(struct abuf *ab, int cy, int cx, int scroll);
 void editorMoveCursor(int key);
 // read
 void editorOpen(char *filename); // FILE IO
+void editorOpenStream(FILE *fp);
+void editorIndexThread();
+void editorIndexPart(size_t k, std::vector<size_t> &ends);
+size_t indexScan(const char *s, size_t n, size_t off, std::vector<size_t> &ends);
+#ifdef __SSE2__
+size_t indexScanSSE2(const char *s, size_t n, size_t off, std::vector<size_t> &ends);
+#endif
+#ifdef SEARCH_X86
+size_t indexScanAVX2(const char *s, size_t n, size_t off, std::vector<size_t> &ends);
+#endif
+int editorIndexPull(int wait);
+void editorIndexStop();
+void editorEnsureRows(int n);
+void editorEnsureAllRows();
 void editorInsertRow(int at, char *s, size_t len);
+void editorInsertRows(int at, const char **s, const size_t *len, int n);
 void editorUpdateRow(erow *row);
+void editorRowRender(erow *row);
+void editorRowReserve(erow *row, int size);
+void editorRowLayout(erow *row, int cap, int rcap, int tabs);
+void editorRowDropRender(erow *row);
 void editorScroll();
 int editorRowCxToRx(erow *row, int cx);
 int editorRowRxToCx(erow *row, int rx);
+int *editorRowTabs(erow *row);
+void editorRowTabsEdit(erow *row, int at, int removed, int added);
+void editorRowTabsFree(erow *row);
 // write
 void editorRowInsertChar(erow *row, int at, int c);
 void editorInsertChar(int c);
 void editorRowAppendString(erow *row, char *s, size_t len);
 void editorInsertNewLine();
+void editorInsertText(const char *s, size_t len);
 // delete
 void editorRowDelChar(erow *row, int at);
 void editorDelChar();
 void editorFreeRow(erow *row);
 void editorDelRow(int at);
+// rows
+erow *editorRowAt(int at);
+int editorRowIndex(erow *row);
+erow *editorRowNext(erow *row);
+erow *editorRowPrev(erow *row);
+rownode *rowTreeMerge(rownode *a, rownode *b);
+rownode *rowTreeBuild(rownode **nodes, int n);
+void rowTreeSplit(rownode *t, int k, rownode **l, rownode **r);
+void rowTreeUpdate(rownode *n);
+unsigned int rowTreeRandom();
+rownode *rowNodeAlloc();
+void rowNodeFree(rownode *n);
+size_t editorRowBlockSize(erow *row);
+// render cache
+void editorCacheTouch(erow *row);
+void editorCacheUnlink(erow *row);
+void editorCacheTrim();
+// pool
+int poolClass(size_t n);
+size_t poolClassSize(int c);
+char *poolAlloc(struct rowPool *pl, size_t n);
+void poolFree(struct rowPool *pl, char *p, size_t n);
+char *poolShrink(struct rowPool *pl, char *p, size_t n, size_t m);
+void poolRelease(struct rowPool *pl);
 // save
-char* editorRowToString(int *buflen);
 void editorSave();
+void editorSaveAppend(const char *p, size_t n);
+void editorSaveThread();
+int editorSaveWrite(int fd);
+int editorSaveWriteLarge(int fd);
+int editorSaveCopy(int fd, size_t off, size_t len);
+void editorSaveProgress(int *percent);
+void editorSaveFinish();
+// large file
+void editorLargeOpen(int fd, size_t size);
+const char *editorLargeView(size_t off, size_t len);
+size_t editorLargeLineEnd(size_t off);
+size_t editorLargeLineStart(size_t end);
+void editorLargeLoad(size_t pos, int rows);
+void editorLargeCommit();
+size_t editorLargeSplit(size_t off, int j);
+void editorLargeFollow();
+size_t editorLargeSavedSize();
+void editorRowsClear();
 
 // prompt
 // char *editorPrompt(char *prompt);
@@ -185,47 +642,126 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)); // function poi
 // find
 void editorFind();
 void editorFindCallback(char *query, int key);
+void editorSearchNarrow(const char *query);
+void editorSearchMapping(struct searcher *sr, std::vector<int> &found, std::vector<size_t> &lines);
+size_t editorMapLine(size_t off, int *len);
+size_t searchCount(const char *s, size_t n, char c);
+void editorMatchQuery(const char *query);
+void editorMatchThread();
+void editorMatchRow(erow *row, int at, std::vector<std::pair<int, int> > &out);
+void editorMatchUpdate(int at);
+void editorMatchShift(int at, int n);
+int editorMatchStep(int direction);
+int editorMatchReady();
+void editorMatchGo(int k);
+void editorSearchCompile(struct searcher *sr, const char *query);
+void editorFindPrompt();
+int searchFind(const struct searcher *sr, const char *s, int n, int from, int *len);
+void searchCompile(struct searcher *sr, const char *needle, int len);
+void searchCompileRegex(struct searcher *sr, const char *pattern);
+int searchHorspool(const struct searcher *sr, const char *hay, int n);
+#ifdef __SSE2__
+int searchSSE2(const struct searcher *sr, const char *hay, int n);
+#endif
+#ifdef SEARCH_X86
+int searchAVX2(const struct searcher *sr, const char *hay, int n);
+#endif
+struct regex *regexCompile(const char *pattern);
+int regexFind(struct regex *re, const char *s, int n, int from, int *len);
+void regexStarts(struct regex *re, const char *s, int n, std::vector<int> &starts);
+int regexLongest(struct regex *re, const char *s, int n, int start);
+void regexFree(struct regex *re);
+int regexNode(struct regexParser *ps, int type);
+struct regexFrag regexJoin(struct regexParser *ps, struct regexFrag a, struct regexFrag b);
+struct regexFrag regexAlt(struct regexParser *ps);
+struct regexFrag regexConcat(struct regexParser *ps);
+struct regexFrag regexRepeat(struct regexParser *ps);
+struct regexFrag regexQuantify(struct regexParser *ps, struct regexFrag a, char q);
+struct regexFrag regexCount(struct regexParser *ps, const char *atom, struct regexFrag a, int min, int max);
+struct regexFrag regexAtom(struct regexParser *ps);
+void regexClass(struct regexParser *ps, unsigned char *set);
+void regexEscape(struct regexParser *ps, unsigned char *set);
+void regexClosure(struct regexProgram *pg, std::vector<int> &stack, int bol, int eol, std::vector<int> &out);
+int regexState(struct regexProgram *pg, std::vector<int> &set, int bol);
+int regexStart(struct regexProgram *pg, int bol);
+int regexNext(struct regexProgram *pg, int st, unsigned char c);
+void regexFlush(struct regexProgram *pg);
 
 // syntax highlighting
 void editorUpdateSyntax(erow *row);
+int editorLexRow(struct editorSyntax *syntax, const char *s, int len, unsigned char *hl, int state);
+void editorHighlightRow(erow *row, int state);
+void editorRowHighlight(erow *row, int at);
+int editorSyntaxStateAt(int at, int limit);
+void editorSyntaxInvalidate(int at);
+void editorHighlightKick();
+void editorHighlightThread();
+void editorHighlightLexer(int slice);
+int editorHighlightSlice(int slice, int slices, int state, std::vector<unsigned char> &scratch);
+void editorHighlightJob(struct hlJob *j, int state, std::vector<unsigned char> &scratch);
+int editorHighlightTarget();
 int editorSyntaxToColor(int hl);
 int is_separator(int c) { return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL; }
 void editorSelectSyntaxHighlight();
 
 // status/message bar
-void editorDrawStatusBar(struct abuf *ab);
+void editorDrawStatusBar(struct screen *s);
 void editorSetStatusMessage(const char *fmt, ...); // ... == variable args
-void editorDrawMessageBar(struct abuf *ab);
+void editorDrawMessageBar(struct screen *s);
 
 // screen
 int getWindowSize(int *rows, int *cols);
+void editorResize();
 int getCursorPosition(int *rows, int *cols);
+void screenResize(struct screen *s, int rows, int cols);
+void screenClear(struct screen *s);
+void screenScroll(struct screen *s, int top, int bottom, int n);
+int screenPut(struct screen *s, int y, int x, const char *text, int len, unsigned char attr);
+void screenAppendAttr(struct abuf *ab, unsigned char from, unsigned char to);
 
 // append buffer
 void abAppend(struct abuf *ab, const char *s, int len);
+void abReserve(struct abuf *ab, int cap);
 void abFree(struct abuf *ab);
+int writeAll(int fd, const char *buf, int len);
 
 // option
 void parseOption(int argc, char * const argv[]) {
     // parse option
     int opt;
-    while((opt = getopt(argc, argv, "d")) != -1) {
+    E.large.threshold = -1; // 0 is a setting: every file in large-file mode
+    E.cache.budget = -1; // ... and no render cache at all
+    while((opt = getopt(argc, argv, "df:l:m:t:")) != -1) {
         switch (opt) {
             case 'd':
                 debug = true;
                 break;
+            case 'f':
+                E.fps = atoi(optarg);
+                break;
+            case 'l':
+                E.large.threshold = atoll(optarg) << 20;
+                break;
+            case 'm':
+                E.cache.budget = atoll(optarg) << 20;
+                break;
+            case 't':
+                E.tabstop = atoi(optarg);
+                break;
         }
     }
 }
 
 int main(int argc, char * const argv[]) {
+    E.lock.lock();
+    atexit(editorWorkersStop);
     parseOption(argc, argv);
     enableRawMode();
     initEditor();
-    if (argc >= 2) editorOpen(argv[1]);
-    editorSetStatusMessage("Ctrl-s: save | Ctrl-q: quit | Ctr-f: find");
+    if (optind < argc) editorOpen(argv[optind]);
+    editorSetStatusMessage("Ctrl-s: save | Ctrl-q: quit | Ctr-f: find | Ctrl-n/p: next/prev match");
     while(1) {
-        editorRefreshScreen();
+        editorFrame();
         editorProcessKeypress();
     }
     return 0;
@@ -249,15 +785,16 @@ void enableRawMode() { // Enable raw mode (non canonical mode)
     raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON); // return | software control
     raw.c_oflag &= ~(OPOST); // output
     raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN); // echo | raw mode | SIGINT, SIGTSTP | waiting another type
-    // min value of bytes of input needed before read()
-    raw.c_cc[VMIN] = 0; // 0 char
-    // time of waiting user
-    raw.c_cc[VTIME] = 1; // * 100 millis
+    // read() only runs once poll() says there is input, and then returns what is there
+    raw.c_cc[VMIN] = 1; // 1 char
+    raw.c_cc[VTIME] = 0; // no timer
     err = tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw); // set termial attribute
     if (err < 0) die("tcsetattr");
+    write(STDOUT_FILENO, "\x1b[?2004h", 8); // bracketed paste: a paste arrives as one block
 }
 
 void disableRawMode() { // Set termial attribute
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     err = tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
     if (err < 0) die("tcsetattr");
 }
@@ -269,77 +806,259 @@ void initEditor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = NULL;
+    E.hl_checkpoints.assign(1, 0);
+    E.hl_valid = 1;
+    E.hl_memo_at = -1;
+    E.hl_scratch = NULL;
+    E.hl_scratch_size = 0;
+    E.map = NULL;
+    E.mapsize = 0;
+    E.map_intact = 0;
+    E.large.on = 0;
+    if (E.large.threshold < 0) E.large.threshold = (long long)LARGE_FILE_MB << 20;
+    E.index.done = true;
+    E.index.stop = false;
+    E.index.merged = 0;
+    E.free_nodes = NULL;
+    memset(E.pool.free, 0, sizeof(E.pool.free));
+    E.pool.at = E.pool.end = NULL;
+    E.pool.live = E.pool.held = 0;
+    E.pool.blocks = 0;
+    E.cache.head = E.cache.tail = NULL;
+    E.cache.bytes = 0;
+    if (E.cache.budget < 0) E.cache.budget = (long long)CACHE_MB << 20;
+    if (E.tabstop < 1 || E.tabstop > 64) E.tabstop = TAB_STOP;
+    E.hl.stop = false;
+    E.hl.edits = 0;
+    E.hl.pos = -1;
+    E.hl.state = 0;
+    E.hl.want = 0;
+    E.hl.lex_gen = 0;
+    E.hl.lex_left = 0;
+    E.search.match_row = -1;
+    E.wake = false;
+    E.match.stop = false;
+    E.match.scanned = 0;
+    E.lock_wanted = 0;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    editorEventsInit();
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows-=2;
+
+    E.screen.chars = E.frame.chars = NULL;
+    E.screen.attrs = E.frame.attrs = NULL;
+    screenResize(&E.screen, E.screenrows + 2, E.screencols);
+    screenResize(&E.frame, E.screenrows + 2, E.screencols);
+    E.screen_valid = 0;
+    E.cursor_y = E.cursor_x = -1;
+
+    E.out.b = NULL;
+    E.out.len = E.out.cap = 0;
+    abReserve(&E.out, (E.screenrows + 2) * E.screencols * 4);
+    E.frames = 0;
+    E.frame_bytes = 0;
+    E.frame_total = 0;
+    E.frame_time.tv_sec = E.frame_time.tv_nsec = 0;
 }
 
 int editorReadKey() { // key input
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
-    }
-
-    if (c == '\x1b') {
-        char seq[3];
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                }
+    while (E.in.head == E.in.tail) {
+        if (editorIdle()) return REFRESH_KEY;
+        if (editorInputFill(-1) == -1 && errno != EINTR) die("read");
+    }
+    char c = E.in.ring[E.in.head++ % INPUT_BUF];
+    if (c == '\x1b') return editorReadEscape();
+    return c;
+}
+
+int editorReadEscape() { // after ESC: the key a sequence stands for, ESC alone or unknown
+    int c = editorInputPeek(0);
+    if (c == '[') { // CSI: parameter bytes, intermediate bytes, final byte
+        unsigned int i = 1;
+        int param = 0;
+        while ((c = editorInputPeek(i)) >= '0' && c <= '9') {
+            param = param * 10 + (c - '0');
+            i++;
+        }
+        while ((c = editorInputPeek(i)) >= 0x20 && c <= 0x3f) i++; // further parameters, modifiers
+        if (c < 0x40 || c > 0x7e) return '\x1b'; // cut short: drop the ESC only
+        E.in.head += i + 1;
+        if (c == '~') {
+            switch (param) {
+                case 1: return HOME_KEY;
+                case 3: return DEL_KEY;
+                case 4: return END_KEY;
+                case 5: return PAGE_UP;
+                case 6: return PAGE_DOWN;
+                case 7: return HOME_KEY;
+                case 8: return END_KEY;
+                case 200: return editorReadPaste();
             }
-        } else if (seq[0] == '0') {
-            switch (seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
+            return '\x1b';
+        }
+    } else if (c == 'O') { // SS3
+        c = editorInputPeek(1);
+        if (c < 0) return '\x1b';
+        E.in.head += 2;
+    } else {
+        return '\x1b';
+    }
+    switch (c) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+    }
+    return '\x1b';
+}
+
+int editorReadPaste() { // after ESC[200~: everything up to ESC[201~
+    static const char end[] = "\x1b[201~";
+    const size_t n = sizeof(end) - 1;
+    std::string &paste = E.in.paste;
+    paste.clear();
+    while (paste.size() < n || paste.compare(paste.size() - n, n, end) != 0) {
+        while (E.in.head == E.in.tail) {
+            if (editorInputFill(-1) == -1 && errno != EINTR) die("read");
+        }
+        // take everything buffered, in at most two pieces around the wrap
+        unsigned int from = E.in.head % INPUT_BUF;
+        unsigned int len = std::min(E.in.tail - E.in.head, INPUT_BUF - from);
+        size_t old = paste.size();
+        paste.append(E.in.ring + from, len);
+        E.in.head += len;
+        size_t at = paste.find(end, old >= n ? old - n + 1 : 0);
+        if (at != std::string::npos) { // hand back what follows the paste
+            E.in.head -= paste.size() - at - n;
+            paste.resize(at + n);
+        }
+    }
+    paste.resize(paste.size() - n);
+    return PASTE_KEY;
+}
+
+int editorInputFill(int timeout) {
+    // sleep in poll() until input or another event, up to timeout ms (-1:
+    // no limit), then read() as much as the ring takes; background threads
+    // have the rows meanwhile
+    struct pollfd fds[4] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { E.ev.wake, POLLIN, 0 },
+        { E.ev.signal, POLLIN, 0 },
+        { E.ev.timer, POLLIN, 0 },
+    };
+    unsigned int from = E.in.tail % INPUT_BUF;
+    unsigned int room = std::min(INPUT_BUF - (E.in.tail - E.in.head), INPUT_BUF - from);
+    E.lock.unlock();
+    int nread = poll(fds, 4, timeout);
+    if (nread > 0) {
+        nread = 0;
+        if (room && fds[0].revents) {
+            nread = read(STDIN_FILENO, E.in.ring + from, room);
+            if (nread == 0) { // the terminal went away
+                nread = -1;
+                errno = EIO;
             }
         }
+    }
+    E.lock_wanted++;
+    E.lock.lock();
+    E.lock_wanted--;
+    editorEventsRead(fds);
+    if (nread > 0) E.in.tail += nread;
+    return nread;
+}
 
-        return '\x1b';
-    } else {
-        return c;
+int editorInputPeek(unsigned int i) { // byte i past head, reading on if it is not here yet; -1 if it does not come
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (E.in.tail - E.in.head <= i) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int left = ESC_TIMEOUT - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (left <= 0) return -1;
+        if (editorInputFill(left) == -1 && errno != EINTR) die("read");
+    }
+    return (unsigned char)E.in.ring[(E.in.head + i) % INPUT_BUF];
+}
+
+void editorEventsInit() {
+    // SIGWINCH is taken from a signalfd; block it before any thread starts so none gets it
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    E.ev.signal = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    E.ev.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    E.ev.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (E.ev.signal == -1 || E.ev.wake == -1 || E.ev.timer == -1) die("editorEventsInit");
+    E.ev.winch = 0;
+}
+
+void editorEventsRead(struct pollfd *fds) { // drain what poll() reported besides the terminal
+    uint64_t count;
+    if (fds[1].revents) read(E.ev.wake, &count, sizeof(count)); // E.wake is already set
+    if (fds[2].revents) {
+        struct signalfd_siginfo si;
+        while (read(E.ev.signal, &si, sizeof(si)) == sizeof(si)) E.ev.winch = 1;
+        E.wake = true;
+    }
+    if (fds[3].revents) {
+        read(E.ev.timer, &count, sizeof(count)); // the status message expired
+        E.wake = true;
+    }
+}
+
+int editorIdle() { // runs while waiting for input; returns 1 if the screen needs a refresh
+    if (!E.wake.exchange(false)) return 0;
+    if (E.ev.winch) {
+        E.ev.winch = 0;
+        editorResize();
     }
+    editorIndexPull(0);
+    editorSaveFinish();
+    return 1;
+}
+
+void editorWake() { // called from background threads
+    uint64_t one = 1;
+    if (!E.wake.exchange(true)) write(E.ev.wake, &one, sizeof(one)); // one write per wakeup is enough
+}
+
+void editorWorkersStop() { // at exit, on the UI thread
+    E.hl.stop = true;
+    E.match.stop = true;
+    E.hl.cond.notify_one();
+    E.match.cond.notify_one();
+    E.lock.unlock(); // workers may be waiting for the rows
+    if (E.hl.thread.joinable()) E.hl.thread.join();
+    if (E.match.thread.joinable()) E.match.thread.join();
+    if (E.save.thread.joinable()) E.save.thread.join(); // finish the file rather than leave a temp behind
 }
 
 void editorProcessKeypress() {
     static int quit_times = QUIT_TIMES;
 
     int c = editorReadKey();
+    if (c == REFRESH_KEY) return;
+    E.search.match_row = -1;
 
     switch (c) {
         case '\r':
             editorInsertNewLine();
             break;
 
+        case PASTE_KEY:
+            editorInsertText(E.in.paste.data(), E.in.paste.size());
+            break;
+
         case CTRL_KEY('q'):
             if (E.dirty && quit_times > 0) {
                 editorSetStatusMessage("File has unsaved. Presss Press Ctrl-Q %d more times to quit.", quit_times);
@@ -360,7 +1079,7 @@ void editorProcessKeypress() {
             break;
 
         case END_KEY:
-            if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+            if (E.cy < E.numrows) E.cx = editorRowAt(E.cy)->size;
             E.cx = E.screencols - 1;
             break;
 
@@ -368,6 +1087,11 @@ void editorProcessKeypress() {
             editorFind();
             break;
 
+        case CTRL_KEY('n'):
+        case CTRL_KEY('p'):
+            editorMatchGo(editorMatchStep(c == CTRL_KEY('n') ? 1 : -1));
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -380,6 +1104,7 @@ void editorProcessKeypress() {
             {
                 if (c == PAGE_UP) E.cy = E.rowoff;
                 else if (c == PAGE_DOWN) {
+                    editorEnsureRows(E.rowoff + E.screenrows);
                     E.cy = E.rowoff + E.screenrows - 1;
                     if (E.cy > E.numrows) E.cy = E.numrows;
                 }
@@ -397,7 +1122,11 @@ void editorProcessKeypress() {
             break;
 
         case CTRL_KEY('l'):
+            E.screen_valid = 0; // repaint everything
+            break;
+
         case '\x1b':
+            editorMatchQuery(""); // done with the last search
             break;
 
         default:
@@ -405,36 +1134,67 @@ void editorProcessKeypress() {
             break;
     }
 
+    editorLargeFollow();
     quit_times = QUIT_TIMES;
 }
 
-void editorRefreshScreen() { // Refresh screen
-    editorScroll();
-
-    struct abuf ab = ABUF_INIT;
-
-    abAppend(&ab, "\x1b[?25l", 6); // hide cursor
-
-    // text
-    editorDrawRows(&ab);
+void editorFrame() { // draw, unless keys already queued would make the frame stale on arrival
+    editorScroll(); // keys handled without a frame still see the offsets it would have left
+    if (editorInputPending() && editorSinceFrame() < FRAME_STALE) return;
+    if (E.fps > 0) { // hold the frame until its slot, taking keys that come meanwhile instead
+        int interval = 1000 / E.fps;
+        int left;
+        while ((left = interval - editorSinceFrame()) > 0) {
+            if (editorInputFill(left) == -1 && errno != EINTR) die("read");
+            if (E.in.head != E.in.tail) return;
+        }
+    }
+    editorRefreshScreen();
+    clock_gettime(CLOCK_MONOTONIC, &E.frame_time);
+}
 
-    // status/message bar
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+int editorInputPending() { // keys read ahead, or waiting at the terminal
+    if (E.in.head != E.in.tail) return 1;
+    struct pollfd in = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&in, 1, 0) == 1;
+}
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1, E.rx - E.coloff + 1); // cursor
-    abAppend(&ab, buf, strlen(buf));
+int editorSinceFrame() { // ms since the last frame
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (now.tv_sec - E.frame_time.tv_sec) * 1000LL + (now.tv_nsec - E.frame_time.tv_nsec) / 1000000;
+    return ms > INT_MAX ? INT_MAX : ms;
+}
 
-    abAppend(&ab, "\x1b[H", 3);
-    abAppend(&ab, "\x1b[?25h", 6); // show cursor
+void editorRefreshScreen() { // Refresh screen
+    editorScroll();
 
-    write(STDOUT_FILENO, ab.b, ab.len); // cursor pos 0,0
-    abFree(&ab);
+    // draw the frame into cells
+    screenClear(&E.frame);
+    editorDrawRows(&E.frame);
+    editorDrawStatusBar(&E.frame);
+    editorDrawMessageBar(&E.frame);
+
+    // text that only moved vertically is scrolled rather than redrawn
+    int scroll = 0;
+    if (E.screen_valid && E.coloff == E.screen_coloff) scroll = E.rowoff - E.screen_rowoff;
+    if (abs(scroll) >= E.screenrows) scroll = 0;
+
+    // send only what differs from the screen, in one write
+    E.out.len = 0;
+    editorFlushScreen(&E.out, E.cy - E.rowoff, E.rx - E.coloff, scroll);
+    if (E.out.len) {
+        writeAll(STDOUT_FILENO, E.out.b, E.out.len);
+        E.frames++;
+    }
+    E.frame_bytes = E.out.len;
+    E.frame_total += E.out.len;
 }
 
+void editorDrawRows(struct screen *s) {
+    editorEnsureRows(E.rowoff + E.screenrows);
 
-void editorDrawRows(struct abuf *ab) {
+    erow *row = editorRowAt(E.rowoff);
     int y;
     for (y = 0; y < E.screenrows; y++) {
         int filerow = y + E.rowoff;
@@ -445,63 +1205,153 @@ void editorDrawRows(struct abuf *ab) {
                 int msglen = snprintf(msg, sizeof(msg), "moec: v%s", VERSION);
                 if (msglen > E.screencols) msglen = E.screencols;
                 int padding = (E.screencols - msglen) / 2;
-                if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) abAppend(ab, " ", 1);
-                abAppend(ab, msg, msglen);
+                if (padding) screenPut(s, y, 0, "~", 1, 0);
+                screenPut(s, y, padding, msg, msglen, 0);
             } else {
-                abAppend(ab, "~", 1);
+                screenPut(s, y, 0, "~", 1, 0);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
+            editorRowHighlight(row, filerow);
+            editorCacheTouch(row);
+            int len = row->rsize - E.coloff;
             if (len < 0) len = 0;
             if (len > E.screencols) len = E.screencols;
 
-            // coloring
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
+            // text in one copy, then colors one run of equal hl at a time
+            char *c = &row->render[E.coloff];
+            unsigned char *hl = &row->hl[E.coloff];
+            char *chars = &s->chars[y * s->cols];
+            unsigned char *attrs = &s->attrs[y * s->cols];
+            memcpy(chars, c, len);
+            int j = 0;
+            while (j < len) {
+                int k = j + 1;
+                while (k < len && hl[k] == hl[j]) k++;
+                memset(&attrs[j], hl[j] == HL_NORMAL ? 0 : editorSyntaxToColor(hl[j]), k - j);
+                j = k;
+            }
+            if (filerow == E.search.match_row) { // search match over the syntax colors
+                int from = editorRowCxToRx(row, E.search.match_col) - E.coloff;
+                int to = editorRowCxToRx(row, E.search.match_col + E.search.match_len) - E.coloff;
+                if (from < 0) from = 0;
+                if (to > len) to = len;
+                if (from < to) memset(&attrs[from], editorSyntaxToColor(HL_MATCH), to - from);
+            }
             for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                if (iscntrl((unsigned char)c[j])) {
+                    chars[j] = (c[j] <= 26) ? '@' + c[j] : '?';
+                    attrs[j] |= ATTR_REVERSE;
                 }
             }
+            row = editorRowNext(row);
+        }
+    }
+    editorCacheTrim();
+}
+
+void editorFlushScreen(struct abuf *ab, int cy, int cx, int scroll) { // diff the frame against the screen
+    struct screen *old = &E.screen;
+    struct screen *cur = &E.frame;
+    char buf[32];
+    int started = 0;
+    unsigned char attr = 0;
+
+    // synchronized output: the terminal shows the frame only once it is complete
+    // (terminals without mode 2026 ignore it)
+    int begin = ab->len;
+    abAppend(ab, "\x1b[?2026h\x1b[?25l", 14);
+
+    if (!E.screen_valid) {
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        screenClear(old);
+        started = 1;
+    } else if (scroll) {
+        // scroll the text area (status and message bars stay put), SU or SD
+        int clen = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                E.screenrows, abs(scroll), scroll > 0 ? 'S' : 'T');
+        abAppend(ab, buf, clen);
+        screenScroll(old, 0, E.screenrows, scroll);
+        started = 1;
+    }
+
+    for (int y = 0; y < cur->rows; y++) {
+        char *oc = &old->chars[y * old->cols], *nc = &cur->chars[y * cur->cols];
+        unsigned char *oa = &old->attrs[y * old->cols], *na = &cur->attrs[y * cur->cols];
+        int cols = cur->cols;
+
+        if (memcmp(oc, nc, cols) == 0 && memcmp(oa, na, cols) == 0) continue;
+
+        // changed rows with multibyte text are rewritten whole so sequences stay intact
+        int whole = 0;
+        for (int x = 0; x < cols && !whole; x++) whole = (oc[x] & 0x80) || (nc[x] & 0x80);
+
+        // the tail of the new row that is blank can be cleared with one EL
+        int end = cols;
+        while (end > 0 && nc[end - 1] == ' ' && na[end - 1] == 0) end--;
 
-            abAppend(ab, "\x1b[39m", 5);
+        int x = 0;
+        while (x < cols) {
+            if (!whole && oc[x] == nc[x] && oa[x] == na[x]) {
+                x++;
+                continue;
+            }
+            // a changed run, extended over short unchanged gaps
+            int start = x, stop = x + 1, gap = 0;
+            for (int k = x + 1; k < cols; k++) {
+                if (whole || oc[k] != nc[k] || oa[k] != na[k]) {
+                    stop = k + 1;
+                    gap = 0;
+                } else if (++gap > DIFF_GAP) {
+                    break;
+                }
+            }
+            started = 1;
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, start + 1);
+            abAppend(ab, buf, clen);
+            int put = stop < end ? stop : end;
+            int k = start;
+            while (k < put) { // one SGR and one copy per run of equal attrs
+                int run = k + 1;
+                while (run < put && na[run] == na[k]) run++;
+                if (na[k] != attr) {
+                    screenAppendAttr(ab, attr, na[k]);
+                    attr = na[k];
+                }
+                abAppend(ab, &nc[k], run - k);
+                k = run;
+            }
+            if (put < stop) {
+                if (attr) {
+                    abAppend(ab, "\x1b[m", 3);
+                    attr = 0;
+                }
+                abAppend(ab, "\x1b[K", 3); // erase line
+                stop = cols;
+            }
+            x = stop;
         }
+    }
 
-        abAppend(ab, "\x1b[K", 3); // erase line
-        abAppend(ab, "\r\n", 2);
+    if (!started) ab->len = begin; // nothing to draw, no need to hide the cursor
+    if (attr) abAppend(ab, "\x1b[m", 3);
+    if (started || cy != E.cursor_y || cx != E.cursor_x) {
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1); // cursor
+        abAppend(ab, buf, clen);
     }
+    if (started) abAppend(ab, "\x1b[?25h\x1b[?2026l", 14); // show cursor, end of frame
+
+    memcpy(old->chars, cur->chars, cur->rows * cur->cols);
+    memcpy(old->attrs, cur->attrs, cur->rows * cur->cols);
+    E.screen_valid = 1;
+    E.screen_rowoff = E.rowoff;
+    E.screen_coloff = E.coloff;
+    E.cursor_y = cy;
+    E.cursor_x = cx;
 }
 
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    editorEnsureRows(E.cy + 2); // the line past the end only exists once indexing is done
+    erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
     switch (key) {
         case ARROW_LEFT:
@@ -509,7 +1359,7 @@ void editorMoveCursor(int key) {
                 E.cx--;
             } else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -528,7 +1378,7 @@ void editorMoveCursor(int key) {
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen) E.cx = rowlen;
 }
@@ -542,6 +1392,47 @@ void editorOpen(char *filename) { // FILE IO
     FILE *fp = fopen(filename, "r");
     if (!fp) die("fopen");
 
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        editorOpenStream(fp);
+        return;
+    }
+    if (st.st_size >= E.large.threshold) {
+        editorLargeOpen(dup(fileno(fp)), st.st_size);
+        fclose(fp);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED) {
+        editorOpenStream(fp);
+        return;
+    }
+    fclose(fp); // the mapping stays valid without the descriptor
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    E.map = (char*)map;
+    E.mapsize = st.st_size;
+    E.map_intact = 1;
+    struct indexPart part = { 0, 0, NULL };
+    E.index.parts.assign((E.mapsize + INDEX_PART - 1) / INDEX_PART, part);
+    E.index.scan = NULL;
+#ifdef __SSE2__
+    E.index.scan = indexScanSSE2;
+#endif
+#ifdef SEARCH_X86
+    if (__builtin_cpu_supports("avx2")) E.index.scan = indexScanAVX2;
+#endif
+    E.index.claimed = 0;
+    E.index.merged = 0;
+    E.index.done = false;
+    E.index.stop = false;
+    int threads = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), E.index.parts.size());
+    for (int i = 0; i < threads; i++) E.index.threads.push_back(std::thread(editorIndexThread));
+    atexit(editorIndexStop);
+    E.dirty = 0;
+}
+
+void editorOpenStream(FILE *fp) { // read line by line, for files that cannot be mapped
     char *line = NULL;
     size_t linecap = 0;
     ssize_t linelen;
@@ -554,56 +1445,299 @@ void editorOpen(char *filename) { // FILE IO
     E.dirty = 0;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
+// loading: the mapping is cut into INDEX_PART pieces that loader threads on
+// every core claim in order. A part holds the lines starting in it; its
+// thread finds their ends with a vector scan and builds its rows in one
+// block as a treap of their own. Row numbers are positions in the tree, so
+// parts need nothing from each other. The UI thread merges finished parts
+// onto the end of the rows.
+void editorIndexThread() {
+    std::vector<size_t> ends;
+    size_t k;
+    while (!E.index.stop && (k = E.index.claimed++) < E.index.parts.size()) editorIndexPart(k, ends);
+}
+
+void editorIndexPart(size_t k, std::vector<size_t> &ends) {
+    size_t lo = k * INDEX_PART, hi = std::min(lo + INDEX_PART, E.mapsize);
+    size_t start = lo;
+    if (lo > 0) { // the line running into the part belongs to the one before
+        char *nl = (char*)memchr(E.map + lo - 1, '\n', hi - lo + 1);
+        start = nl ? nl - E.map + 1 : hi;
+    }
+    ends.clear();
+    size_t next = start < hi ? indexScan(E.map + start, hi - start, start, ends) : start;
+    if (next < hi) { // the last line starting here ends further on
+        char *nl = (char*)memchr(E.map + hi, '\n', E.mapsize - hi);
+        ends.push_back(nl ? nl - E.map : E.mapsize);
+    }
+
+    int n = ends.size();
+    rownode *nodes = n ? (rownode*)malloc(sizeof(rownode) * n) : NULL;
+    rownode **order = (rownode**)malloc(sizeof(rownode*) * (n + 1));
+    for (int i = 0; i < n; i++) {
+        size_t len = ends[i] - start;
+        while (len > 0 && (E.map[start + len - 1] == '\n' || E.map[start + len - 1] == '\r')) len--;
+
+        rownode *node = &nodes[i];
+        node->prio = rowTreeRandom();
+        erow *row = &node->row;
+        row->size = len;
+        row->chars = E.map + start;
+        row->mapped = 1;
+        row->frozen = 0;
+        row->rsize = 0;
+        row->render = NULL;
+        row->hl = NULL;
+        row->block = NULL;
+        row->cap = row->rcap = row->tabs = 0;
+        row->tab = NULL;
+        row->ntab = -1;
+        row->tabcap = 0;
+        row->lru_prev = row->lru_next = NULL;
+        row->hl_start = -1;
+        row->hl_open_comment = 0;
+        order[i] = node;
+        start = ends[i] + 1;
+    }
+    rownode *root = rowTreeBuild(order, n);
+    free(order);
+
+    std::lock_guard<std::mutex> lk(E.index.lock);
+    struct indexPart *part = &E.index.parts[k];
+    part->count = n;
+    part->root = root;
+    part->built = 1;
+    E.index.cond.notify_all();
+    editorWake();
+}
+
+size_t indexScan(const char *s, size_t n, size_t off, std::vector<size_t> &ends) {
+    // push off + i for every newline s[i]; returns where the line after the last one starts
+    size_t i = E.index.scan ? E.index.scan(s, n, off, ends) : 0;
+    size_t next = ends.empty() ? off : ends.back() + 1;
+    for (; i < n; i++) {
+        if (s[i] != '\n') continue;
+        ends.push_back(off + i);
+        next = off + i + 1;
+    }
+    return next;
+}
+
+#ifdef __SSE2__
+size_t indexScanSSE2(const char *s, size_t n, size_t off, std::vector<size_t> &ends) { // returns bytes scanned
+    __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s + i)), nl));
+        for (; mask; mask &= mask - 1) ends.push_back(off + i + __builtin_ctz(mask));
+    }
+    return i;
+}
+#endif
+
+#ifdef SEARCH_X86
+__attribute__((target("avx2")))
+size_t indexScanAVX2(const char *s, size_t n, size_t off, std::vector<size_t> &ends) {
+    __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        unsigned long long lo = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + i)), nl));
+        unsigned long long hi = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + i + 32)), nl));
+        for (unsigned long long mask = lo | hi << 32; mask; mask &= mask - 1) ends.push_back(off + i + __builtin_ctzll(mask));
+    }
+    return i;
+}
+#endif
+
+int editorIndexPull(int wait) { // merge loaded parts into the rows; returns 1 while more may come
+    if (!E.map || E.index.done) return 0;
+    std::vector<struct indexPart> ready;
+    {
+        std::unique_lock<std::mutex> lk(E.index.lock);
+        std::vector<struct indexPart> &parts = E.index.parts;
+        if (wait) E.index.cond.wait(lk, [&parts] { return parts[E.index.merged].built; });
+        while (E.index.merged < parts.size() && parts[E.index.merged].built) ready.push_back(parts[E.index.merged++]);
+    }
+    for (size_t i = 0; i < ready.size(); i++) {
+        struct indexPart *part = &ready[i];
+        if (part->count == 0) continue;
+        E.rows = rowTreeMerge(E.rows, part->root);
+        E.rows->parent = NULL;
+        E.numrows += part->count;
+    }
+    if (ready.size() && !E.match.sr.needle.empty()) E.match.cond.notify_one(); // more rows to index
+    if (E.index.merged == E.index.parts.size()) {
+        E.index.done = true;
+        editorIndexStop();
+        std::vector<struct indexPart>().swap(E.index.parts);
+    }
+    return !E.index.done;
+}
+
+void editorIndexStop() {
+    E.index.stop = true;
+    {
+        std::lock_guard<std::mutex> lk(E.index.lock);
+        E.index.cond.notify_all();
+    }
+    for (size_t i = 0; i < E.index.threads.size(); i++) {
+        if (E.index.threads[i].joinable()) E.index.threads[i].join();
+    }
+    E.index.threads.clear();
+}
 
-    E.row = (erow*)realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+void editorEnsureRows(int n) {
+    while (E.numrows < n && editorIndexPull(1));
+}
 
-    E.row[at].idx = at;
+void editorEnsureAllRows() {
+    while (editorIndexPull(1));
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = (char*)malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+void editorInsertRow(int at, char *s, size_t len) {
+    const char *line = s;
+    editorInsertRows(at, &line, &len, 1);
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+void editorInsertRows(int at, const char **s, const size_t *len, int n) { // n rows in one split and merge
+    if (at < 0 || at > E.numrows || n <= 0) return;
+
+    rownode **nodes = (rownode**)malloc(sizeof(rownode*) * n);
+    for (int i = 0; i < n; i++) {
+        rownode *node = rowNodeAlloc();
+        node->prio = rowTreeRandom();
+
+        erow *row = &node->row;
+        row->size = 0;
+        row->chars = NULL;
+        row->block = NULL;
+        row->cap = row->rcap = 0;
+        row->tab = NULL;
+        row->ntab = -1;
+        row->tabcap = 0;
+        row->lru_prev = row->lru_next = NULL;
+        row->mapped = 0;
+        row->frozen = 0;
+        int tabs = 0;
+        for (size_t j = 0; j < len[i]; j++) tabs += (s[i][j] == '\t');
+        editorRowLayout(row, len[i] + 1, len[i] + tabs*(E.tabstop - 1) + 1, tabs); // sized for its render: one malloc a row
+        memcpy(row->chars, s[i], len[i]);
+        row->size = len[i];
+        row->chars[len[i]] = '\0';
+
+        row->rsize = 0;
+        row->hl_start = -1;
+        row->hl_open_comment = 0;
+        nodes[i] = node;
+    }
 
-    E.numrows++;
+    rownode *l, *r;
+    rowTreeSplit(E.rows, at, &l, &r);
+    E.rows = rowTreeMerge(rowTreeMerge(l, rowTreeBuild(nodes, n)), r);
+    E.map_intact = 0;
+    E.rows->parent = NULL;
+    E.numrows += n;
+    editorMatchShift(at, n);
+
+    editorSyntaxInvalidate(at);
+    for (int i = 0; i < n; i++) editorUpdateRow(&nodes[i]->row);
+    free(nodes);
     E.dirty++;
 }
 
-void editorUpdateRow(erow *row) {
+void editorUpdateRow(erow *row) { // the row's text changed
+    E.hl.edits++;
+    editorMatchUpdate(editorRowIndex(row));
+    editorRowRender(row);
+    editorUpdateSyntax(row); // highlight
+}
+
+void editorRowRender(erow *row) {
     int tabs = 0;
     int j;
     for (j = 0; j < row->size; j++) if (row->chars[j] == '\t') tabs++;
 
-    free(row->render);
-    row->render = (char*)malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+    int rcap = row->size + tabs*(E.tabstop - 1) + 1;
+    if (!row->block || rcap > row->rcap || !tabs != !row->tabs) {
+        if (rcap > row->rcap && rcap < row->rcap * 2) rcap = row->rcap * 2;
+        if (rcap < row->rcap) rcap = row->rcap;
+        editorRowLayout(row, row->cap, rcap, tabs);
+    }
+    row->tabs = tabs;
+    if (!tabs) { // nothing to expand: draw straight from chars
+        row->render = row->chars;
+        row->rsize = row->size;
+        return;
+    }
+    row->render = row->block + row->cap;
 
     int idx = 0;
     for (j = 0; j < row->size; j++) {
         if (row->chars[j] == '\t') {
             row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
+            while (idx % E.tabstop != 0) row->render[idx++] = ' ';
         } else {
             row->render[idx++] = row->chars[j];
         }
     }
     row->render[idx] = '\0';
     row->rsize = idx;
+}
 
-    editorUpdateSyntax(row); // highlight
+void editorRowReserve(erow *row, int size) { // room for size chars of the row's own, before they change
+    // a mapped or snapshotted row is copied first; capacity grows by doubling
+    if (row->frozen && !E.save.active) row->frozen = 0;
+    if (!row->mapped && !row->frozen && size < row->cap) return;
+    if (row->mapped) E.map_intact = 0;
+    int cap = size + 1;
+    if (size < row->cap) cap = row->cap;
+    else if (cap < row->cap * 2) cap = row->cap * 2;
+    int rcap = cap + row->tabs*(E.tabstop - 1);
+    editorRowLayout(row, cap, rcap > row->rcap ? rcap : row->rcap, row->tabs);
+}
+
+void editorRowLayout(erow *row, int cap, int rcap, int tabs) { // move the row to a new block
+    // chars come along (cap 0 leaves them mapped); render and hl are to be rebuilt
+    size_t size = cap + (tabs ? rcap : 0) + rcap;
+    char *block = size ? poolAlloc(&E.pool, size) : NULL;
+    if (cap && row->chars) memcpy(block, row->chars, row->size);
+    if (cap) block[row->size] = '\0';
+    editorFreeRow(row);
+    if (cap) {
+        row->chars = block;
+        row->mapped = 0;
+    }
+    row->frozen = 0;
+    row->block = block;
+    row->cap = cap;
+    row->rcap = rcap;
+    row->tabs = tabs;
+    row->render = NULL;
+    row->hl = NULL;
+    if (rcap) {
+        E.cache.bytes += size - cap;
+        editorCacheTouch(row);
+    }
+}
+
+void editorRowDropRender(erow *row) { // give up render and hl space, keeping chars where they are
+    size_t size = editorRowBlockSize(row);
+    E.cache.bytes -= size - row->cap;
+    editorCacheUnlink(row);
+    if (row->cap) row->block = row->chars = poolShrink(&E.pool, row->block, size, row->cap);
+    else {
+        poolFree(&E.pool, row->block, size);
+        row->block = NULL;
+    }
+    row->rcap = 0;
+    row->tabs = 0;
+    row->render = NULL;
+    row->hl = NULL;
 }
 
 void editorScroll() {
     E.rx = 0;
-    if (E.cy < E.numrows) E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    if (E.cy < E.numrows) E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
 
 
     if (E.cy < E.rowoff) E.rowoff = E.cy;
@@ -616,32 +1750,100 @@ void editorScroll() {
     if (E.rx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
 }
 
+/*** tab index ***/
+
+// columns: every other char is one render column wide, so a column maps
+// through the last tab before it. row->tab holds, per tab, its column in
+// chars and the render column just past it; both mappings are a binary
+// search over it. It is built on first use and kept up to date by edits.
+
 int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') rx += TAB_STOP - 1 - rx % TAB_STOP;
-        rx++;
+    int *tab = editorRowTabs(row);
+    int lo = 0, hi = row->ntab; // tabs before cx
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (tab[2*mid] < cx) lo = mid + 1;
+        else hi = mid;
     }
-    return rx;
+    if (lo == 0) return cx;
+    return tab[2*lo - 1] + cx - tab[2*lo - 2] - 1;
 }
 
 int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') cur_rx += TAB_STOP - 1 - cur_rx % TAB_STOP;
-        cur_rx++;
-        if (cur_rx > rx) return cx;
+    int *tab = editorRowTabs(row);
+    int lo = 0, hi = row->ntab; // tabs ending at or before rx
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (tab[2*mid + 1] <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+    int cx = lo ? tab[2*lo - 2] + 1 + rx - tab[2*lo - 1] : rx;
+    if (lo < row->ntab && cx > tab[2*lo]) cx = tab[2*lo]; // rx is inside the next tab
+    return cx < row->size ? cx : row->size;
+}
+
+int *editorRowTabs(erow *row) { // the row's tab index, built if it has none
+    if (row->ntab >= 0) return row->tab;
+    row->ntab = 0;
+    editorRowTabsEdit(row, 0, 0, row->size);
+    return row->tab;
+}
+
+void editorRowTabsEdit(erow *row, int at, int removed, int added) { // chars at..at+added replaced removed chars
+    if (row->ntab < 0) return; // built when next needed
+    int *tab = row->tab;
+    int lo = 0, hi = row->ntab; // first tab at or after at
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (tab[2*mid] < at) lo = mid + 1;
+        else hi = mid;
     }
-    return cx;
+    int j = lo, e, k; // tabs j to e were in the removed chars
+    for (e = j; e < row->ntab && tab[2*e] < at + removed; e++);
+    int tabs = 0;
+    for (const char *p = row->chars + at, *end = p + added; (p = (const char*)memchr(p, '\t', end - p)); p++) tabs++;
+
+    int n = row->ntab - (e - j) + tabs;
+    if (n > row->tabcap) { // grow by doubling, filling out the pool class
+        size_t want = 2 * sizeof(int) * (n < row->tabcap * 2 ? row->tabcap * 2 : n);
+        int c = poolClass(want);
+        int cap = (c < POOL_CLASSES ? poolClassSize(c) : want) / (2 * sizeof(int));
+        tab = (int*)poolAlloc(&E.pool, 2 * sizeof(int) * cap);
+        if (row->ntab) memcpy(tab, row->tab, 2 * sizeof(int) * row->ntab);
+        editorRowTabsFree(row);
+        row->tab = tab;
+        row->tabcap = cap;
+    }
+    if (e < row->ntab) memmove(&tab[2*(j + tabs)], &tab[2*e], 2 * sizeof(int) * (row->ntab - e));
+    for (k = j + tabs; k < n; k++) tab[2*k] += added - removed;
+    k = j;
+    for (const char *p = row->chars + at, *end = p + added; (p = (const char*)memchr(p, '\t', end - p)); p++) tab[2*k++] = p - row->chars;
+    row->ntab = n;
+
+    // render columns from the first changed tab on; once one comes out as
+    // before, the rest are only shifted along with it and stand
+    for (k = j; k < n; k++) {
+        int rx = k ? tab[2*k - 1] + tab[2*k] - tab[2*k - 2] - 1 : tab[0];
+        rx += E.tabstop - rx % E.tabstop;
+        if (k >= j + tabs && tab[2*k + 1] == rx) break;
+        tab[2*k + 1] = rx;
+    }
+}
+
+void editorRowTabsFree(erow *row) {
+    if (!row->tab) return;
+    poolFree(&E.pool, (char*)row->tab, 2 * sizeof(int) * row->tabcap);
+    row->tab = NULL;
+    row->tabcap = 0;
 }
 
 void editorRowDelChar(erow *row, int at) {
     bool isNotInRange = at < 0 || at >= row->size;
     if (isNotInRange) return;
+    editorRowReserve(row, row->size);
     memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
     row->size--;
+    editorRowTabsEdit(row, at, 1, 0);
     editorUpdateRow(row);
     E.dirty++;
 }
@@ -649,13 +1851,14 @@ void editorRowDelChar(erow *row, int at) {
 void editorDelChar() {
     if (E.cy == E.numrows) return; // last line
     if (E.cx == 0 && E.cy == 0) return;
-    erow *row = &E.row[E.cy]; // copy target line
+    erow *row = editorRowAt(E.cy); // copy target line
     if (E.cx > 0) { // del char
         editorRowDelChar(row, E.cx - 1);
         E.cx--;
     } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        erow *prev = editorRowPrev(row);
+        E.cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->size);
         editorDelRow(E.cy);
         E.cy--;
     }
@@ -671,9 +1874,10 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
     while(1) {
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        editorFrame();
 
         int c = editorReadKey();
+        if (c == REFRESH_KEY) continue;
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
             if (buflen != 0) buf[--buflen] = '\0';
         } else if (c == '\x1b') {
@@ -687,6 +1891,15 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
                 if (callback) callback(buf, c);
                 return buf;
             }
+        } else if (c == PASTE_KEY) { // the first line of it
+            std::string &paste = E.in.paste;
+            size_t n = 0;
+            while (n < paste.size() && paste[n] != '\r' && paste[n] != '\n') n++;
+            while (buflen + n >= bufsize) bufsize *= 2;
+            buf = (char*)realloc(buf, bufsize);
+            memcpy(buf + buflen, paste.data(), n);
+            buflen += n;
+            buf[buflen] = '\0';
         } else if (!iscntrl(c) && c < 128) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
@@ -707,8 +1920,8 @@ void editorFind() {
     int saved_coloff = E.coloff;
     int saved_rowoff = E.rowoff;
 
-    char *msg = (char*)"Search: %s (ESC: cancel | Arrow: move | Enter: end)";
-    char *query = editorPrompt(msg, editorFindCallback);
+    editorFindPrompt();
+    char *query = editorPrompt(E.search.prompt, editorFindCallback);
 
     if (query) free(query);
     else {
@@ -723,19 +1936,26 @@ void editorFindCallback(char *query, int key) {
     static int last_match = -1;
     static int direction = 1;
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
-
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl,saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+    E.search.match_row = -1;
+    if (key == CTRL_KEY('r')) { // switch between plain text and regular expressions
+        E.search.regex = !E.search.regex;
+        editorFindPrompt();
+        E.search.query.clear();
+        E.search.hits.clear();
+        E.search.lines.clear();
+        editorMatchQuery(query);
     }
+    if (key == '\x1b') editorMatchQuery("");
+    else if (E.match.sr.needle != query) editorMatchQuery(query);
 
     // move direction
     if (key == '\r' || key == '\x1b') {
         last_match = -1;
         direction = 1;
+        // the hit lists are only good until the next edit
+        E.search.query.clear();
+        std::vector<std::vector<int> >().swap(E.search.hits);
+        std::vector<std::vector<size_t> >().swap(E.search.lines);
         return;
     // ->, |
     //     v
@@ -751,70 +1971,1065 @@ void editorFindCallback(char *query, int key) {
     }
 
     if (last_match == -1) direction = 1;
-    int current = last_match;
-
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
-
-        erow *row = &E.row[i];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = (char*)malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+
+    if (last_match != -1 && editorMatchReady()) { // every match is known: step to the next one
+        editorMatchGo(editorMatchStep(direction));
+        last_match = E.cy;
+        E.rowoff = E.numrows;
+        return;
     }
-}
+
+    editorSearchNarrow(query);
+    if (E.search.hits.empty() || E.search.hits.back().empty()) return;
+    std::vector<int> &hits = E.search.hits.back();
+
+    // the next row holding a match, wrapping around either end
+    int current;
+    if (direction == 1) {
+        std::vector<int>::iterator it = std::upper_bound(hits.begin(), hits.end(), last_match);
+        current = (it == hits.end()) ? hits.front() : *it;
+    } else {
+        std::vector<int>::iterator it = std::lower_bound(hits.begin(), hits.end(), last_match);
+        current = (it == hits.begin()) ? hits.back() : *(it - 1);
+    }
+
+    editorEnsureRows(current + 1); // the file may still be loading past the hit
+    erow *row = editorRowAt(current);
+    last_match = current;
+    E.cy = current;
+    int len = 0;
+    E.cx = searchFind(&E.search.sr, row->chars, row->size, 0, &len);
+    E.rowoff = E.numrows;
+
+    E.search.match_row = current;
+    E.search.match_col = E.cx;
+    E.search.match_len = len;
+}
+
+void editorFindPrompt() {
+    snprintf(E.search.prompt, sizeof(E.search.prompt), "%s%s: %%s (ESC: cancel | Arrow: move | Enter: end | Ctrl-R: %s)",
+        E.search.regex ? "Regex" : "Search", E.large.on ? " window" : "", E.search.regex ? "text" : "regex");
+}
+
+void editorSearchNarrow(const char *query) { // bring the hit lists up to query
+    struct search *s = &E.search;
+    if (s->regex) { // a longer pattern may match more: rescan every row, once per query
+        if (s->query == query && s->hits.size()) return;
+        s->query = query;
+        editorSearchCompile(&s->sr, query);
+        std::vector<int> found;
+        std::vector<size_t> lines;
+        int i = 0;
+        if (E.map_intact) { // file as opened: its lines, loaded as rows or not
+            for (size_t off = 0, next; off < E.mapsize; off = next, i++) {
+                int len;
+                next = editorMapLine(off, &len);
+                if (searchFind(&s->sr, E.map + off, len, 0, NULL) >= 0) found.push_back(i), lines.push_back(off);
+            }
+        } else {
+            editorEnsureAllRows();
+            for (erow *row = editorRowAt(0); row; row = editorRowNext(row), i++) {
+                if (searchFind(&s->sr, row->chars, row->size, 0, NULL) >= 0) found.push_back(i);
+            }
+        }
+        s->hits.assign(1, found);
+        s->lines.assign(1, lines);
+        return;
+    }
+    size_t keep = 0;
+    while (keep < s->hits.size() && query[keep] == s->query[keep]) keep++;
+    s->hits.resize(keep);
+    s->lines.resize(keep);
+    s->query.resize(keep);
+
+    for (; query[keep]; keep++) {
+        s->query.push_back(query[keep]);
+        searchCompile(&s->sr, s->query.data(), s->query.size());
+        std::vector<int> found;
+        std::vector<size_t> lines;
+        if (keep == 0 && E.map_intact) { // first byte, file as opened: scan the mapping itself
+            editorSearchMapping(&s->sr, found, lines);
+        } else if (keep == 0) { // first byte: every row
+            editorEnsureAllRows();
+            int i = 0;
+            for (erow *row = editorRowAt(0); row; row = editorRowNext(row), i++) {
+                if (searchFind(&s->sr, row->chars, row->size, 0, NULL) >= 0) found.push_back(i);
+            }
+        } else if (s->lines[keep - 1].size() == s->hits[keep - 1].size()) { // the lines of the mapping that held it
+            std::vector<int> &prev = s->hits[keep - 1];
+            std::vector<size_t> &from = s->lines[keep - 1];
+            for (size_t k = 0; k < prev.size(); k++) {
+                int len;
+                editorMapLine(from[k], &len);
+                if (searchFind(&s->sr, E.map + from[k], len, 0, NULL) >= 0) found.push_back(prev[k]), lines.push_back(from[k]);
+            }
+        } else { // a longer query only matches rows that held the shorter one
+            std::vector<int> &prev = s->hits[keep - 1];
+            erow *row = NULL;
+            int at = 0;
+            for (size_t k = 0; k < prev.size(); k++) {
+                int i = prev[k];
+                if (row && i - at < 64) {
+                    while (at < i) row = editorRowNext(row), at++;
+                } else {
+                    row = editorRowAt(i);
+                    at = i;
+                }
+                if (searchFind(&s->sr, row->chars, row->size, 0, NULL) >= 0) found.push_back(i);
+            }
+        }
+        s->hits.push_back(found);
+        s->lines.push_back(lines);
+    }
+    if (s->query.size()) searchCompile(&s->sr, s->query.data(), s->query.size());
+}
+
+void editorSearchMapping(struct searcher *sr, std::vector<int> &found, std::vector<size_t> &lines) { // rows holding a match, and where they start, from the mapping
+    const size_t chunk = 1 << 30; // find() takes an int length
+    size_t m = sr->needle.size();
+    size_t off = 0, counted = 0;
+    int row = 0;
+    while (off + m <= E.mapsize) {
+        size_t n = E.mapsize - off;
+        if (n > chunk) n = chunk;
+        int r = sr->find(sr, E.map + off, n);
+        if (r < 0) {
+            if (off + n == E.mapsize) break;
+            off += n - m + 1;
+            continue;
+        }
+        // the query holds no newline, so the match lies inside one line
+        size_t hit = off + r;
+        row += searchCount(E.map + counted, hit - counted, '\n');
+        found.push_back(row);
+        char *start = (char*)memrchr(E.map + counted, '\n', hit - counted);
+        lines.push_back(start ? start - E.map + 1 : counted);
+        char *nl = (char*)memchr(E.map + hit, '\n', E.mapsize - hit);
+        if (!nl) break;
+        off = counted = nl - E.map + 1;
+        row++;
+    }
+}
+
+size_t editorMapLine(size_t off, int *len) { // the line of the mapping at off: its length as a row, and where the next starts
+    char *nl = (char*)memchr(E.map + off, '\n', E.mapsize - off);
+    size_t end = nl ? nl - E.map : E.mapsize;
+    size_t n = end - off;
+    while (n > 0 && (E.map[off + n - 1] == '\n' || E.map[off + n - 1] == '\r')) n--;
+    *len = n;
+    return nl ? end + 1 : E.mapsize;
+}
+
+size_t searchCount(const char *s, size_t n, char c) { // occurrences of c in s
+    size_t count = 0, i = 0;
+#ifdef __SSE2__
+    __m128i cc = _mm_set1_epi8(c);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, cc)));
+    }
+#endif
+    for (; i < n; i++) count += (s[i] == c);
+    return count;
+}
+
+void editorMatchQuery(const char *query) { // index every match of query, "" to drop the index
+    editorSearchCompile(&E.match.sr, query);
+    std::vector<std::pair<int, int> >().swap(E.match.hits);
+    E.match.scanned = 0;
+    if (!query[0]) return;
+    if (!E.match.thread.joinable()) E.match.thread = std::thread(editorMatchThread);
+    E.match.cond.notify_one();
+}
+
+void editorMatchThread() {
+    std::unique_lock<std::mutex> buf(E.lock);
+    while (!E.match.stop) {
+        if (E.match.sr.needle.empty() || E.match.scanned >= E.numrows) {
+            E.match.cond.wait(buf);
+            continue;
+        }
+        int at = E.match.scanned;
+        erow *row = editorRowAt(at);
+        size_t bytes = 0; // long rows make short batches
+        for (int n = 0; row && n < MATCH_BATCH && bytes < MATCH_BATCH_BYTES; n++, at++, row = editorRowNext(row)) {
+            editorMatchRow(row, at, E.match.hits);
+            bytes += row->size + 1;
+        }
+        E.match.scanned = at;
+        editorWake(); // for the count in the status bar
+        // let the UI thread at the rows before the next batch
+        buf.unlock();
+        while (E.lock_wanted) std::this_thread::yield();
+        buf.lock();
+    }
+}
+
+void editorMatchRow(erow *row, int at, std::vector<std::pair<int, int> > &out) { // append the row's matches
+    int col = 0, len;
+    if (E.match.sr.regex) { // the row's starts in one pass, then each match from its start
+        if (!E.match.sr.re) return;
+        std::vector<int> &starts = E.match.starts;
+        regexStarts(E.match.sr.re, row->chars, row->size, starts);
+        for (size_t i = 0; i < starts.size(); i++) {
+            if (starts[i] < col || (len = regexLongest(E.match.sr.re, row->chars, row->size, starts[i])) < 0) continue;
+            out.push_back(std::make_pair(at, starts[i]));
+            col = starts[i] + len;
+        }
+        return;
+    }
+    while (col <= row->size) {
+        int r = searchFind(&E.match.sr, row->chars, row->size, col, &len);
+        if (r < 0) break;
+        out.push_back(std::make_pair(at, r));
+        col = r + len;
+    }
+}
+
+void editorMatchUpdate(int at) { // row at was edited: rescan just that row
+    if (E.match.sr.needle.empty() || at >= E.match.scanned) return;
+    std::vector<std::pair<int, int> > &hits = E.match.hits;
+    std::vector<std::pair<int, int> >::iterator from = std::lower_bound(hits.begin(), hits.end(), std::make_pair(at, 0));
+    std::vector<std::pair<int, int> >::iterator to = std::lower_bound(from, hits.end(), std::make_pair(at + 1, 0));
+    std::vector<std::pair<int, int> > found;
+    editorMatchRow(editorRowAt(at), at, found);
+    hits.insert(hits.erase(from, to), found.begin(), found.end());
+}
+
+void editorMatchShift(int at, int n) { // n rows were inserted at at (n > 0), or the row at at deleted (n = -1)
+    assert(n >= -1); // deletions drop the hits of one row only
+    if (E.match.sr.needle.empty()) return;
+    std::vector<std::pair<int, int> > &hits = E.match.hits;
+    std::vector<std::pair<int, int> >::iterator it = std::lower_bound(hits.begin(), hits.end(), std::make_pair(at, 0));
+    if (n < 0) it = hits.erase(it, std::lower_bound(it, hits.end(), std::make_pair(at + 1, 0)));
+    for (; it != hits.end(); ++it) it->first += n;
+    if (at < E.match.scanned) E.match.scanned += n;
+}
+
+int editorMatchStep(int direction) { // the match after (or before) the cursor, wrapping; -1 if none
+    std::vector<std::pair<int, int> > &hits = E.match.hits;
+    if (hits.empty()) return -1;
+    std::pair<int, int> cursor(E.cy, E.cx);
+    if (direction == 1) {
+        std::vector<std::pair<int, int> >::iterator it = std::upper_bound(hits.begin(), hits.end(), cursor);
+        return it == hits.end() ? 0 : it - hits.begin();
+    }
+    std::vector<std::pair<int, int> >::iterator it = std::lower_bound(hits.begin(), hits.end(), cursor);
+    return it == hits.begin() ? hits.size() - 1 : it - hits.begin() - 1;
+}
+
+int editorMatchReady() {
+    return !E.match.sr.needle.empty() && E.match.scanned >= E.numrows && E.index.done;
+}
+
+void editorMatchGo(int k) { // put the cursor on match k and highlight it
+    if (k < 0) return;
+    E.cy = E.match.hits[k].first;
+    E.cx = E.match.hits[k].second;
+    E.search.match_row = E.cy;
+    E.search.match_col = E.cx;
+    erow *row = editorRowAt(E.cy);
+    searchFind(&E.match.sr, row->chars, row->size, E.cx, &E.search.match_len);
+}
+
+void editorSearchCompile(struct searcher *sr, const char *query) { // as text or as a regex, per the search mode
+    if (E.search.regex) searchCompileRegex(sr, query);
+    else searchCompile(sr, query, strlen(query));
+}
+
+int searchFind(const struct searcher *sr, const char *s, int n, int from, int *len) {
+    // offset of the first match at or after from, -1 if none; its length in *len
+    if (sr->regex) return sr->re ? regexFind(sr->re, s, n, from, len) : -1;
+    int m = sr->needle.size();
+    if (m == 0 || from + m > n) return -1;
+    int r = sr->find(sr, s + from, n - from);
+    if (r < 0) return -1;
+    if (len) *len = m;
+    return from + r;
+}
+
+// search: compare the first and last byte of the query against 16 or 32
+// windows at once and memcmp the few that pass; Horspool for the tail and
+// where there is no SIMD
+void searchCompile(struct searcher *sr, const char *needle, int len) {
+    if (sr->re) regexFree(sr->re);
+    sr->re = NULL;
+    sr->regex = 0;
+    sr->needle.assign(needle, len);
+    for (int i = 0; i < 256; i++) sr->skip[i] = len;
+    for (int i = 0; i < len - 1; i++) sr->skip[(unsigned char)needle[i]] = len - 1 - i;
+    sr->find = searchHorspool;
+#ifdef __SSE2__
+    sr->find = searchSSE2;
+#endif
+#ifdef SEARCH_X86
+    if (__builtin_cpu_supports("avx2")) sr->find = searchAVX2;
+#endif
+}
+
+int searchHorspool(const struct searcher *sr, const char *hay, int n) {
+    int m = sr->needle.size();
+    const char *p = sr->needle.data();
+    for (int i = 0; i + m <= n; i += sr->skip[(unsigned char)hay[i + m - 1]]) {
+        if (hay[i + m - 1] == p[m - 1] && !memcmp(hay + i, p, m - 1)) return i;
+    }
+    return -1;
+}
+
+#ifdef __SSE2__
+int searchSSE2(const struct searcher *sr, const char *hay, int n) {
+    int m = sr->needle.size();
+    const char *p = sr->needle.data();
+    __m128i first = _mm_set1_epi8(p[0]);
+    __m128i last = _mm_set1_epi8(p[m - 1]);
+    int i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (m <= 2 || !memcmp(hay + i + bit + 1, p + 1, m - 2)) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    int r = searchHorspool(sr, hay + i, n - i);
+    return r < 0 ? -1 : i + r;
+}
+#endif
+
+#ifdef SEARCH_X86
+__attribute__((target("avx2")))
+int searchAVX2(const struct searcher *sr, const char *hay, int n) {
+    int m = sr->needle.size();
+    const char *p = sr->needle.data();
+    __m256i first = _mm256_set1_epi8(p[0]);
+    __m256i last = _mm256_set1_epi8(p[m - 1]);
+    int i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(hay + i + m - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (m <= 2 || !memcmp(hay + i + bit + 1, p + 1, m - 2)) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    int r = searchHorspool(sr, hay + i, n - i);
+    return r < 0 ? -1 : i + r;
+}
+#endif
+
+void searchCompileRegex(struct searcher *sr, const char *pattern) { // a malformed pattern matches nothing
+    if (sr->re) regexFree(sr->re);
+    sr->needle = pattern;
+    sr->regex = 1;
+    sr->re = pattern[0] ? regexCompile(pattern) : NULL;
+}
+
+// regex: a Thompson NFA per direction, turned into a DFA lazily, one state
+// per set of NFA states seen. Matching is leftmost-longest in two linear
+// passes: the reversed pattern, unanchored, run from the end of the row back
+// finds where the leftmost match starts; the pattern anchored there finds
+// where the longest one ends. No backtracking.
+struct regex *regexCompile(const char *pattern) { // NULL if the pattern is malformed
+    struct regex *re = new regex;
+    for (int dir = 0; dir < 2; dir++) {
+        struct regexProgram *pg = dir ? &re->rev : &re->fwd;
+        struct regexParser ps = { pattern, dir, &pg->nodes, 0 };
+        struct regexFrag f = regexAlt(&ps);
+        if (ps.error || *ps.p) {
+            delete re;
+            return NULL;
+        }
+        int match = regexNode(&ps, RE_MATCH);
+        pg->nodes[f.out].out1 = match;
+        pg->start = f.in;
+        pg->unanchored = dir; // the reverse pass looks for every start at once
+        pg->mark.assign(pg->nodes.size() * 2, 0);
+        pg->markgen = 0;
+        pg->flushes = 0;
+        regexFlush(pg);
+    }
+    return re;
+}
+
+int regexFind(struct regex *re, const char *s, int n, int from, int *len) {
+    // reverse pass: the leftmost position a match can start at
+    struct regexProgram *pg = &re->rev;
+    int st = regexStart(pg, 1); // the reversed text starts at the end of the row
+    int start = -1;
+    for (int i = n - 1; i >= from; i--) {
+        st = regexNext(pg, st, s[i]);
+        if (i == 0 ? pg->eol_accept[st] : pg->accept[st]) start = i;
+    }
+    if (start < 0) return -1;
+
+    int m = regexLongest(re, s, n, start);
+    if (m < 0) return -1;
+    if (len) *len = m;
+    return start;
+}
+
+void regexStarts(struct regex *re, const char *s, int n, std::vector<int> &starts) {
+    // every offset a match starts at, ascending: one reverse pass serves all
+    // the matches of a row, where regexFind would make one per match
+    struct regexProgram *pg = &re->rev;
+    int st = regexStart(pg, 1);
+    starts.clear();
+    for (int i = n - 1; i >= 0; i--) {
+        st = regexNext(pg, st, s[i]);
+        if (i == 0 ? pg->eol_accept[st] : pg->accept[st]) starts.push_back(i);
+    }
+    std::reverse(starts.begin(), starts.end());
+}
+
+int regexLongest(struct regex *re, const char *s, int n, int start) { // length of the longest match at start, -1 if none
+    struct regexProgram *pg = &re->fwd;
+    int st = regexStart(pg, start == 0);
+    int end = -1, i;
+    for (i = start; i < n; i++) {
+        st = regexNext(pg, st, s[i]);
+        if (pg->sets[st].empty()) break;
+        if (pg->accept[st]) end = i + 1;
+    }
+    if (i == n && pg->eol_accept[st]) end = n;
+    return end < 0 ? -1 : end - start;
+}
+
+void regexFree(struct regex *re) {
+    delete re;
+}
+
+int regexNode(struct regexParser *ps, int type) {
+    struct rnode n;
+    n.type = type;
+    n.out1 = n.out2 = -1;
+    memset(n.set, 0, sizeof(n.set));
+    if (ps->nodes->size() >= RE_MAX_NODES) ps->error = 1; // the node is still made, the caller links it
+    ps->nodes->push_back(n);
+    return ps->nodes->size() - 1;
+}
+
+struct regexFrag regexJoin(struct regexParser *ps, struct regexFrag a, struct regexFrag b) { // a then b, in the parse direction
+    std::vector<rnode> &nodes = *ps->nodes;
+    if (ps->reverse) std::swap(a, b);
+    nodes[a.out].out1 = b.in;
+    a.out = b.out;
+    return a;
+}
+
+struct regexFrag regexAlt(struct regexParser *ps) { // a|b|...
+    struct regexFrag a = regexConcat(ps);
+    while (!ps->error && *ps->p == '|') {
+        ps->p++;
+        struct regexFrag b = regexConcat(ps);
+        int split = regexNode(ps, RE_SPLIT);
+        int end = regexNode(ps, RE_EMPTY);
+        std::vector<rnode> &nodes = *ps->nodes;
+        nodes[split].out1 = a.in;
+        nodes[split].out2 = b.in;
+        nodes[a.out].out1 = end;
+        nodes[b.out].out1 = end;
+        a.in = split;
+        a.out = end;
+    }
+    return a;
+}
+
+struct regexFrag regexConcat(struct regexParser *ps) { // abc...
+    int empty = regexNode(ps, RE_EMPTY);
+    struct regexFrag a = { empty, empty };
+    while (!ps->error && *ps->p && *ps->p != '|' && *ps->p != ')') a = regexJoin(ps, a, regexRepeat(ps));
+    return a;
+}
+
+struct regexFrag regexRepeat(struct regexParser *ps) { // atom followed by * + ? {m} {m,} {m,n}
+    const char *atom = ps->p;
+    struct regexFrag a = regexAtom(ps);
+    while (!ps->error) {
+        char c = *ps->p;
+        if (c == '*' || c == '+' || c == '?') {
+            ps->p++;
+            a = regexQuantify(ps, a, c);
+        } else if (c == '{') {
+            int min = 0, max;
+            ps->p++;
+            if (!isdigit((unsigned char)*ps->p)) break;
+            while (isdigit((unsigned char)*ps->p)) min = min * 10 + (*ps->p++ - '0');
+            max = min;
+            if (*ps->p == ',') {
+                ps->p++;
+                if (isdigit((unsigned char)*ps->p)) {
+                    max = 0;
+                    while (isdigit((unsigned char)*ps->p)) max = max * 10 + (*ps->p++ - '0');
+                } else {
+                    max = -1;
+                }
+            }
+            if (*ps->p++ != '}' || min > RE_MAX_REPEAT || max > RE_MAX_REPEAT || (max >= 0 && max < min)) {
+                ps->error = 1;
+                break;
+            }
+            a = regexCount(ps, atom, a, min, max);
+        } else {
+            break;
+        }
+    }
+    return a;
+}
+
+struct regexFrag regexQuantify(struct regexParser *ps, struct regexFrag a, char q) {
+    int split = regexNode(ps, RE_SPLIT);
+    int end = regexNode(ps, RE_EMPTY);
+    std::vector<rnode> &nodes = *ps->nodes;
+    nodes[split].out1 = a.in;
+    nodes[split].out2 = end;
+    nodes[a.out].out1 = (q == '?') ? end : split;
+    a.in = (q == '+') ? a.in : split;
+    a.out = end;
+    return a;
+}
+
+struct regexFrag regexCount(struct regexParser *ps, const char *atom, struct regexFrag a, int min, int max) {
+    // the atom is parsed again for every copy
+    const char *after = ps->p;
+    int copies = (max < 0) ? min + 1 : max;
+    struct regexFrag r = a;
+    if (copies == 0) {
+        int empty = regexNode(ps, RE_EMPTY);
+        r.in = r.out = empty;
+    }
+    for (int i = 0; i < copies && !ps->error; i++) {
+        struct regexFrag c = a;
+        if (i > 0) {
+            ps->p = atom;
+            c = regexAtom(ps);
+        }
+        if (i >= min) c = regexQuantify(ps, c, (max < 0) ? '*' : '?');
+        r = (i == 0) ? c : regexJoin(ps, r, c);
+    }
+    ps->p = after;
+    return r;
+}
+
+struct regexFrag regexAtom(struct regexParser *ps) {
+    struct regexFrag a;
+    char c = *ps->p;
+    if (c == '(') {
+        ps->p++;
+        a = regexAlt(ps);
+        if (*ps->p != ')') ps->error = 1;
+        else ps->p++;
+        return a;
+    }
+    if (c == '^' || c == '$') { // the ends swap places in the reversed pattern
+        ps->p++;
+        int n = regexNode(ps, ((c == '^') != (ps->reverse != 0)) ? RE_BOL : RE_EOL);
+        int end = regexNode(ps, RE_EMPTY);
+        (*ps->nodes)[n].out1 = end;
+        a.in = n;
+        a.out = end;
+        return a;
+    }
+
+    unsigned char set[32];
+    memset(set, 0, sizeof(set));
+    if (c == '.') {
+        ps->p++;
+        memset(set, 0xff, sizeof(set));
+    } else if (c == '[') {
+        ps->p++;
+        regexClass(ps, set);
+    } else if (c == '\\') {
+        ps->p++;
+        regexEscape(ps, set);
+    } else if (c == '\0' || c == '*' || c == '+' || c == '?' || c == '{' || c == ')' || c == '|') {
+        ps->error = 1;
+    } else {
+        ps->p++;
+        set[(unsigned char)c >> 3] |= 1 << (c & 7);
+    }
+    int n = regexNode(ps, RE_CHAR);
+    int end = regexNode(ps, RE_EMPTY);
+    std::vector<rnode> &nodes = *ps->nodes;
+    memcpy(nodes[n].set, set, sizeof(set));
+    nodes[n].out1 = end;
+    a.in = n;
+    a.out = end;
+    return a;
+}
+
+void regexClass(struct regexParser *ps, unsigned char *set) { // after '[': [abc] [^abc] [a-z] [\d_]
+    int negate = (*ps->p == '^');
+    if (negate) ps->p++;
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        first = 0;
+        if (*ps->p == '\\') {
+            ps->p++;
+            regexEscape(ps, set);
+            continue;
+        }
+        unsigned char lo = *ps->p++, hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            hi = ps->p[1];
+            ps->p += 2;
+        }
+        for (int c = lo; c <= hi; c++) set[c >> 3] |= 1 << (c & 7);
+    }
+    if (*ps->p != ']') {
+        ps->error = 1;
+        return;
+    }
+    ps->p++;
+    if (negate) for (int i = 0; i < 32; i++) set[i] = ~set[i];
+}
+
+void regexEscape(struct regexParser *ps, unsigned char *set) { // after '\': adds the bytes it stands for
+    char e = *ps->p;
+    if (e == '\0') {
+        ps->error = 1;
+        return;
+    }
+    ps->p++;
+    int (*is)(int) = NULL;
+    switch (tolower((unsigned char)e)) {
+        case 'd': is = isdigit; break;
+        case 's': is = isspace; break;
+        case 'w': is = isalnum; break;
+    }
+    if (!is) {
+        unsigned char c = (e == 't') ? '\t' : e;
+        set[c >> 3] |= 1 << (c & 7);
+        return;
+    }
+    int negate = isupper((unsigned char)e) != 0;
+    for (int c = 0; c < 256; c++) {
+        int in = (c < 128 && is(c)) || (c == '_' && is == isalnum);
+        if (in != negate) set[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+void regexClosure(struct regexProgram *pg, std::vector<int> &stack, int bol, int eol, std::vector<int> &out) {
+    // states reachable from stack without reading a byte; only the ones
+    // that read a byte, wait for the end of the row or match are kept
+    pg->markgen++;
+    while (!stack.empty()) {
+        int id = stack.back();
+        stack.pop_back();
+        if (pg->mark[id] == pg->markgen) continue;
+        pg->mark[id] = pg->markgen;
+        struct rnode *n = &pg->nodes[id >> 1];
+        int consumed = id & 1;
+        switch (n->type) {
+            case RE_SPLIT:
+                stack.push_back(n->out2 * 2 + consumed);
+                stack.push_back(n->out1 * 2 + consumed);
+                break;
+            case RE_EMPTY:
+                stack.push_back(n->out1 * 2 + consumed);
+                break;
+            case RE_BOL:
+                if (bol) stack.push_back(n->out1 * 2 + consumed);
+                break;
+            case RE_EOL:
+                if (eol) stack.push_back(n->out1 * 2 + consumed);
+                else out.push_back(id);
+                break;
+            default:
+                out.push_back(id);
+        }
+    }
+    std::sort(out.begin(), out.end());
+}
+
+int regexState(struct regexProgram *pg, std::vector<int> &set, int bol) { // DFA state for a closed set
+    if (bol) set.insert(set.begin(), -1);
+    std::map<std::vector<int>, int>::iterator it = pg->ids.find(set);
+    if (it != pg->ids.end()) return it->second;
+    if ((int)pg->sets.size() >= RE_MAX_STATES) regexFlush(pg);
+
+    int id = pg->sets.size();
+    pg->ids[set] = id;
+    pg->sets.push_back(set);
+    pg->next.resize((id + 1) * 256, -1);
+
+    // whether it matches here, and whether it would at the end of the row
+    std::vector<int> stack, end;
+    int accept = 0;
+    for (size_t i = 0; i < set.size(); i++) {
+        if (set[i] < 0) continue;
+        int type = pg->nodes[set[i] >> 1].type;
+        if (type == RE_MATCH && (set[i] & 1)) accept = 1;
+        if (type == RE_EOL) stack.push_back(pg->nodes[set[i] >> 1].out1 * 2 + (set[i] & 1));
+    }
+    int eol_accept = accept;
+    regexClosure(pg, stack, bol, 1, end);
+    for (size_t i = 0; i < end.size(); i++) {
+        if (pg->nodes[end[i] >> 1].type == RE_MATCH && (end[i] & 1)) eol_accept = 1;
+    }
+    pg->accept.push_back(accept);
+    pg->eol_accept.push_back(eol_accept);
+    return id;
+}
+
+int regexStart(struct regexProgram *pg, int bol) {
+    if (pg->start_id[bol] >= 0) return pg->start_id[bol];
+    std::vector<int> stack(1, pg->start * 2), set;
+    regexClosure(pg, stack, bol, 0, set);
+    return pg->start_id[bol] = regexState(pg, set, bol);
+}
+
+int regexNext(struct regexProgram *pg, int st, unsigned char c) {
+    int next = pg->next[st * 256 + c];
+    if (next >= 0) return next;
+
+    std::vector<int> stack, set;
+    std::vector<int> &from = pg->sets[st];
+    for (size_t i = 0; i < from.size(); i++) {
+        if (from[i] < 0) continue;
+        struct rnode *n = &pg->nodes[from[i] >> 1];
+        if (n->type == RE_CHAR && (n->set[c >> 3] >> (c & 7) & 1)) stack.push_back(n->out1 * 2 + 1);
+    }
+    if (pg->unanchored) stack.push_back(pg->start * 2);
+    regexClosure(pg, stack, 0, 0, set);
+    int flushes = pg->flushes;
+    next = regexState(pg, set, 0);
+    if (pg->flushes == flushes) pg->next[st * 256 + c] = next;
+    return next;
+}
+
+void regexFlush(struct regexProgram *pg) { // drop every DFA state, they are rebuilt as needed
+    pg->ids.clear();
+    pg->sets.clear();
+    pg->next.clear();
+    pg->accept.clear();
+    pg->eol_accept.clear();
+    pg->start_id[0] = pg->start_id[1] = -1;
+    pg->flushes++;
+}
 
 // syntax highlighting
-void editorUpdateSyntax(erow *row) {
-    row->hl = (unsigned char*)realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->size); // initialize with HL_NORMAL
+void editorUpdateSyntax(erow *row) { // rehighlight an edited row
+    int at = editorRowIndex(row);
+    int start = editorSyntaxStateAt(at, HL_SYNC_ROWS);
+    int known = (start != -1 && row->hl_start == start);
+    if (start == -1) start = row->hl_start > 0 ? row->hl_start : 0;
+    int old_end = row->hl_open_comment;
+    editorHighlightRow(row, start);
+    // rows below only need another look if this row now ends differently
+    if (!known || row->hl_open_comment != old_end) editorSyntaxInvalidate(at + 1);
+}
+
+void editorHighlightRow(erow *row, int state) {
+    if (!row->render) editorRowRender(row);
+    row->hl = (unsigned char*)row->block + row->cap + (row->tabs ? row->rcap : 0);
+    row->hl_start = state;
+    row->hl_open_comment = editorLexRow(E.syntax, row->render, row->rsize, row->hl, state);
+}
+
+void editorRowHighlight(erow *row, int at) { // make render and hl ready for drawing
+    int state = editorSyntaxStateAt(at, HL_SYNC_ROWS);
+    if (state == -1) { // too far from a known state: draw what we have until the highlighter catches up
+        if (at > E.hl.want) E.hl.want = at;
+        editorHighlightKick();
+        if (row->render && row->hl) return;
+        state = row->hl_start > 0 ? row->hl_start : 0;
+    }
+    if (row->render && row->hl && row->hl_start == state) return;
+    editorHighlightRow(row, state);
+}
+
+// render cache: render and hl are rebuilt from chars and the lexer
+// checkpoints whenever a row is drawn without them, so only the rows drawn
+// last need to keep them. Rows go to the front of the list as they are
+// drawn; after each frame the ones at the back give their space up until
+// the cache is within budget.
+void editorCacheTouch(erow *row) { // move to the front
+    struct renderCache *c = &E.cache;
+    if (c->head == row) return;
+    editorCacheUnlink(row);
+    row->lru_next = c->head;
+    if (c->head) c->head->lru_prev = row;
+    c->head = row;
+    if (!c->tail) c->tail = row;
+}
+
+void editorCacheUnlink(erow *row) {
+    struct renderCache *c = &E.cache;
+    if (row->lru_prev) row->lru_prev->lru_next = row->lru_next;
+    else if (c->head == row) c->head = row->lru_next;
+    else return; // not in the list
+    if (row->lru_next) row->lru_next->lru_prev = row->lru_prev;
+    else c->tail = row->lru_prev;
+    row->lru_prev = row->lru_next = NULL;
+}
+
+void editorCacheTrim() { // evict from the back down to the budget, sparing the rows on screen
+    erow *row = E.cache.tail;
+    while (row && E.cache.bytes > E.cache.budget) {
+        erow *prev = row->lru_prev;
+        int at = editorRowIndex(row);
+        int on_screen = at >= E.rowoff && at < E.rowoff + E.screenrows;
+        // a frozen row's block belongs to the save until it is done
+        if (!on_screen && !(row->frozen && E.save.active)) editorRowDropRender(row);
+        row = prev;
+    }
+}
+
+int editorSyntaxStateAt(int at, int limit) { // lexer state at the start of row at, -1 if more than limit rows away
+    if (E.syntax == NULL || at <= 0) return 0;
+    // start from the nearest checkpoint, or from the last answer if that is closer
+    int k = at / HL_CHECKPOINT;
+    if (k >= E.hl_valid) k = E.hl_valid - 1;
+    int from = k * HL_CHECKPOINT;
+    int state = E.hl_checkpoints[k];
+    if (E.hl_memo_at > from && E.hl_memo_at <= at) {
+        from = E.hl_memo_at;
+        state = E.hl_memo_state;
+    }
+    if (limit && at - from > limit) return -1;
+
+    erow *row = editorRowAt(from);
+    for (int i = from; i < at; i++) {
+        if (row->hl_start != state) { // lex again, only for the end state
+            if (E.hl_scratch_size < row->size) {
+                E.hl_scratch_size = row->size;
+                E.hl_scratch = (unsigned char*)realloc(E.hl_scratch, row->size);
+            }
+            row->hl = NULL; // built from another start state
+            row->hl_start = state;
+            row->hl_open_comment = editorLexRow(E.syntax, row->chars, row->size, E.hl_scratch, state);
+        }
+        state = row->hl_open_comment;
+        row = editorRowNext(row);
+        if ((i + 1) % HL_CHECKPOINT == 0 && (i + 1) / HL_CHECKPOINT == E.hl_valid) {
+            if ((int)E.hl_checkpoints.size() == E.hl_valid) E.hl_checkpoints.push_back(state);
+            else E.hl_checkpoints[E.hl_valid] = state;
+            E.hl_valid++;
+        }
+    }
+    E.hl_memo_at = at;
+    E.hl_memo_state = state;
+    return state;
+}
+
+void editorSyntaxInvalidate(int at) { // start states of rows from at on may have changed
+    int valid = (at + HL_CHECKPOINT - 1) / HL_CHECKPOINT;
+    if (valid < 1) valid = 1;
+    if (valid < E.hl_valid) E.hl_valid = valid;
+    if (E.hl_memo_at >= at) E.hl_memo_at = -1;
+    if (E.hl.pos >= at) E.hl.pos = -1;
+    E.hl.edits++;
+    editorHighlightKick();
+}
+
+void editorHighlightKick() { // hand the rows below the checkpoints to the highlighter
+    if (E.syntax == NULL || E.hl_valid >= editorHighlightTarget()) return;
+    if (!E.hl.thread.joinable()) E.hl.thread = std::thread(editorHighlightThread);
+    E.hl.cond.notify_one();
+}
+
+int editorHighlightTarget() { // checkpoints the highlighter should bring up to date
+    int target = E.hl_checkpoints.size();
+    if (E.hl.want / HL_CHECKPOINT + 1 > target) target = E.hl.want / HL_CHECKPOINT + 1;
+    if (E.numrows / HL_CHECKPOINT + 1 < target) target = E.numrows / HL_CHECKPOINT + 1;
+    return E.syntax ? target : 0;
+}
+
+// a batch of HL_BATCH rows per core is cut into slices lexed in parallel.
+// Only the first slice knows its start state; the others guess "not in a
+// comment or string", which is nearly always right. A pass over the slice
+// boundaries then lexes again, with the real state, the rows where the guess
+// was wrong, until the states agree again.
+void editorHighlightThread() {
+    int cores = std::thread::hardware_concurrency();
+    for (int i = 1; i < cores; i++) E.hl.lexers.push_back(std::thread(editorHighlightLexer, i));
+    int slices = E.hl.lexers.size() + 1;
+
+    std::unique_lock<std::mutex> buf(E.lock);
+    std::vector<hlJob> &jobs = E.hl.jobs;
+    std::vector<char> &text = E.hl.text;
+    std::vector<unsigned char> scratch;
+    while (!E.hl.stop) {
+        if (E.hl_valid >= editorHighlightTarget()) {
+            E.hl.cond.wait(buf);
+            continue;
+        }
+        if (E.hl.pos < 0) {
+            E.hl.pos = (E.hl_valid - 1) * HL_CHECKPOINT;
+            E.hl.state = E.hl_checkpoints[E.hl_valid - 1];
+        }
+        int from = E.hl.pos;
+        int n = E.numrows - from;
+        if (n > HL_BATCH * slices) n = HL_BATCH * slices;
+        if (n <= 0) {
+            E.hl.cond.wait(buf);
+            continue;
+        }
+
+        // copy the batch out, so the UI can have the rows back while it is lexed
+        E.hl.syntax = E.syntax;
+        int edits = E.hl.batch_edits = E.hl.edits;
+        jobs.resize(n);
+        text.clear();
+        erow *row = editorRowAt(from);
+        for (int i = 0; i < n; i++, row = editorRowNext(row)) {
+            hlJob *j = &jobs[i];
+            j->row = row;
+            j->draw = (row->hl != NULL);
+            j->off = text.size();
+            j->len = j->draw ? row->rsize : row->size;
+            text.insert(text.end(), j->draw ? row->render : row->chars, (j->draw ? row->render : row->chars) + j->len);
+            j->start = row->hl_start;
+            j->end = row->hl_open_comment;
+            j->lexed = 0;
+            j->hl = NULL;
+        }
+        int state = E.hl.state;
+        buf.unlock();
+
+        int parts = n > HL_BATCH ? slices : 1;
+        if (parts > 1) {
+            std::lock_guard<std::mutex> lk(E.hl.lex_lock);
+            E.hl.lex_left = parts - 1;
+            E.hl.lex_gen++;
+            E.hl.lex_cond.notify_all();
+        }
+        int cancelled = editorHighlightSlice(0, parts, state, scratch) < 0;
+        if (parts > 1) {
+            std::unique_lock<std::mutex> lk(E.hl.lex_lock);
+            E.hl.lex_cond.wait(lk, [] { return E.hl.lex_left == 0; });
+        }
+        for (int s = 1; s < parts && !cancelled; s++) { // fix up the slices that guessed wrong
+            int at = (long long)n * s / parts;
+            state = jobs[at - 1].end;
+            for (int i = at; i < n && jobs[i].start != state; i++) {
+                editorHighlightJob(&jobs[i], state, scratch);
+                state = jobs[i].end;
+            }
+        }
+
+        buf.lock();
+        if (cancelled || E.hl.edits != edits || E.hl.pos != from) { // a newer edit wins
+            for (int i = 0; i < n; i++) free(jobs[i].hl);
+            continue;
+        }
+        int redraw = 0;
+        for (int i = 0; i < n; i++) {
+            hlJob *j = &jobs[i];
+            row = j->row;
+            if (j->lexed && row->hl_start != j->start) {
+                row->hl_start = j->start;
+                row->hl_open_comment = j->end;
+                if (row->hl && j->draw && j->hl && j->len == row->rsize) { // publish the new colors
+                    memcpy(row->hl, j->hl, j->len);
+                    redraw = 1;
+                } else if (row->hl) { // drawn since the batch was copied: lexed again when next drawn
+                    row->hl = NULL;
+                    redraw = 1;
+                }
+            }
+            free(j->hl);
+            int k = (from + i + 1) / HL_CHECKPOINT;
+            if ((from + i + 1) % HL_CHECKPOINT == 0 && k == E.hl_valid) {
+                if ((int)E.hl_checkpoints.size() == E.hl_valid) E.hl_checkpoints.push_back(j->end);
+                else E.hl_checkpoints[E.hl_valid] = j->end;
+                E.hl_valid++;
+            }
+        }
+        E.hl.pos = from + n;
+        E.hl.state = jobs[n - 1].end;
+        if (redraw || E.hl_valid >= editorHighlightTarget()) editorWake();
+    }
+    buf.unlock();
 
-    if (E.syntax == NULL) return;
+    {
+        std::lock_guard<std::mutex> lk(E.hl.lex_lock);
+        E.hl.lex_cond.notify_all();
+    }
+    for (size_t i = 0; i < E.hl.lexers.size(); i++) E.hl.lexers[i].join();
+}
 
-    char **keywords = E.syntax->keywords;
+void editorHighlightLexer(int slice) { // lexes slice of every parallel batch
+    std::vector<unsigned char> scratch;
+    int gen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lk(E.hl.lex_lock);
+            E.hl.lex_cond.wait(lk, [gen] { return E.hl.lex_gen != gen || E.hl.stop; });
+            if (E.hl.lex_gen == gen) return; // stopped, with no batch left to lex
+            gen = E.hl.lex_gen;
+        }
+        editorHighlightSlice(slice, E.hl.lexers.size() + 1, 0, scratch);
+        std::lock_guard<std::mutex> lk(E.hl.lex_lock);
+        if (--E.hl.lex_left == 0) E.hl.lex_cond.notify_all();
+    }
+}
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+int editorHighlightSlice(int slice, int slices, int state, std::vector<unsigned char> &scratch) {
+    // lex a slice of the batch from state; returns the state at its end, -1 if an edit cancelled it
+    int n = E.hl.jobs.size();
+    int from = (long long)n * slice / slices, to = (long long)n * (slice + 1) / slices;
+    for (int i = from; i < to; i++) {
+        hlJob *j = &E.hl.jobs[i];
+        if (j->start != state) editorHighlightJob(j, state, scratch);
+        state = j->end;
+        if (i % 64 == 63 && E.hl.edits != E.hl.batch_edits) return -1;
+    }
+    return state;
+}
+
+void editorHighlightJob(struct hlJob *j, int state, std::vector<unsigned char> &scratch) { // lex one row of the batch
+    unsigned char *hl;
+    if (j->draw) {
+        if (!j->hl) j->hl = (unsigned char*)malloc(j->len ? j->len : 1);
+        hl = j->hl;
+    } else {
+        if ((int)scratch.size() < j->len + 1) scratch.resize(j->len + 1);
+        hl = &scratch[0];
+    }
+    j->lexed = 1;
+    j->start = state;
+    j->end = editorLexRow(E.hl.syntax, E.hl.text.data() + j->off, j->len, hl, state);
+}
+
+int editorLexRow(struct editorSyntax *syntax, const char *s, int len, unsigned char *hl, int state) { // returns the state at the end
+    memset(hl, HL_NORMAL, len); // initialize with HL_NORMAL
+
+    if (syntax == NULL) return 0;
+
+    char *scs = syntax->singleline_comment_start;
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
 
     int scs_len = scs ? strlen(scs) : 0;
     int mcs_len = mcs ? strlen(mcs) : 0;
     int mce_len = mce ? strlen(mce) : 0;
 
     int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    int in_comment = state & 1;
+    int in_string = state >> 1;
 
     int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    while (i < len) {
+        char c = s[i];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
 
         if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+            if (i + scs_len <= len && !strncmp(&s[i], scs, scs_len)) {
+                memset(&hl[i], HL_COMMENT, len - i);
                 break;
             }
         }
 
         if (mcs_len && mce_len && !in_string) {
             if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                hl[i] = HL_MLCOMMENT;
+                if (i + mce_len <= len && !strncmp(&s[i], mce, mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -823,19 +3038,19 @@ void editorUpdateSyntax(erow *row) {
                     i++;
                     continue;
                 }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+            } else if (i + mcs_len <= len && !strncmp(&s[i], mcs, mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
             if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
+                hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < len) {
+                    hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -846,39 +3061,36 @@ void editorUpdateSyntax(erow *row) {
             } else {
                 if (c == '"' || c == '\'') {
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl[i] = HL_STRING;
                     i++;
                     continue;
                 }
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+        if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
             bool flag = isdigit(c);
             flag &= prev_sep || prev_hl == HL_NUMBER;
             flag |= (c == '.' && prev_hl == HL_NUMBER);
             if (flag) {
-                row->hl[i] = HL_NUMBER;
+                hl[i] = HL_NUMBER;
                 i++;
                 prev_sep = 0;
                 continue;
             }
         }
 
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
-
-                if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
+        if (prev_sep) { // one hash of the word, one compare against the keyword it could be
+            unsigned int hash = KW_HASH_INIT;
+            int j = i;
+            if (syntax->flags & HL_KEYWORDS_NOCASE)
+                for (; j < len && !is_separator(s[j]); j++) hash = kwStep(hash, tolower((unsigned char)s[j]));
+            else
+                for (; j < len && !is_separator(s[j]); j++) hash = kwStep(hash, s[j]);
+            int type = syntax->keyword(&s[i], j - i, hash);
+            if (type != HL_NORMAL) {
+                memset(&hl[i], type, j - i);
+                i = j;
                 prev_sep = 0;
                 continue;
             }
@@ -888,9 +3100,9 @@ void editorUpdateSyntax(erow *row) {
         i++;
     }
 
-     int changed = (row->hl_open_comment != in_comment);
-      row->hl_open_comment = in_comment;
-      if (changed && row->idx + 1 < E.numrows) editorUpdateSyntax(&E.row[row->idx + 1]);
+    // strings only continue on the next line after a trailing backslash
+    if (in_string && !(len > 0 && s[len - 1] == '\\')) in_string = 0;
+    return in_comment | (in_string << 1);
 }
 
 int editorSyntaxToColor(int hl) {
@@ -908,7 +3120,13 @@ int editorSyntaxToColor(int hl) {
 
 void editorSelectSyntaxHighlight() {
     E.syntax = NULL;
-    if (E.filename == NULL) return;
+    // rows are rehighlighted lazily as they are drawn
+    for (erow *row = editorRowAt(0); row; row = editorRowNext(row)) {
+        row->hl = NULL;
+        row->hl_start = -1;
+    }
+    editorSyntaxInvalidate(0);
+    if (E.filename == NULL || E.large.on) return;
 
     char *ext = strrchr(E.filename, '.');
 
@@ -919,11 +3137,6 @@ void editorSelectSyntaxHighlight() {
             int is_ext = (s->filematch[i][0] == '.');
             if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i]))) {
                 E.syntax = s;
-
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
                 return;
             }
             i++;
@@ -931,17 +3144,22 @@ void editorSelectSyntaxHighlight() {
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab) { // status bar
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar(struct screen *s) { // status bar
+    int y = E.screenrows;
     char status[80], rstatus[80];
     int len = snprintf(
             status,
             sizeof(status),
-            "%.20s - %d lines %s",
+            "%.20s - %d%s lines %s",
             E.filename ? E.filename : "[No Name]",
             E.numrows,
+            E.index.done ? "" : "+",
             E.dirty ? "(modified)" : ""
         );
+    if (E.large.on) { // line numbers are not known, where the window is in the file is
+        len = snprintf(status, sizeof(status), "%.20s - large file %d%% %s",
+                E.filename, (int)(E.large.start * 100 / E.large.size), E.dirty ? "(modified)" : "");
+    }
     int rlen = snprintf(
             rstatus,
             sizeof(rstatus),
@@ -951,19 +3169,38 @@ void editorDrawStatusBar(struct abuf *ab) { // status bar
             E.numrows,
             E.cx + 1
         );
+    if (!E.match.sr.needle.empty()) {
+        std::vector<std::pair<int, int> > &hits = E.match.hits;
+        std::pair<int, int> cursor(E.cy, E.cx);
+        std::vector<std::pair<int, int> >::iterator it = std::lower_bound(hits.begin(), hits.end(), cursor);
+        const char *more = editorMatchReady() ? "" : "+"; // still scanning, or still loading
+        const char *scope = E.large.on ? " in window" : ""; // large-file mode searches the loaded rows only
+        if (it != hits.end() && *it == cursor)
+            len += snprintf(status + len, sizeof(status) - len, " | match %d of %d%s%s", (int)(it - hits.begin()) + 1, (int)hits.size(), more, scope);
+        else
+            len += snprintf(status + len, sizeof(status) - len, " | %d%s matches%s", (int)hits.size(), more, scope);
+        if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+    }
+    if (E.save.active) {
+        len += snprintf(status + len, sizeof(status) - len, " | saving %d%%", (int)(E.save.written * 100 / (E.save.total ? E.save.total : 1)));
+        if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+    }
+    if (debug) {
+        len += snprintf(status + len, sizeof(status) - len, " | %dB/frame, %lldB avg | rows %lldK/%lldK",
+                E.frame_bytes, E.frames ? E.frame_total / E.frames : 0, E.pool.live >> 10, E.pool.held >> 10);
+        if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+    }
     if (len > E.screencols) len = E.screencols;
-    abAppend(ab, status, len);
+    screenPut(s, y, 0, status, len, ATTR_REVERSE);
     while (len < E.screencols) {
         if (E.screenrows - len == rlen) {
-            abAppend(ab, rstatus, rlen);
+            screenPut(s, y, len, rstatus, rlen, ATTR_REVERSE);
             break;
         } else {
-            abAppend(ab, " ", 1);
+            screenPut(s, y, len, " ", 1, ATTR_REVERSE);
             len++;
         }
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -972,62 +3209,124 @@ void editorSetStatusMessage(const char *fmt, ...) {
     vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
     va_end(ap);
     E.statusmsg_time = time(NULL);
+    struct itimerspec expire = { { 0, 0 }, { STATUS_TIMEOUT, 0 } }; // redraw once it is due to go
+    timerfd_settime(E.ev.timer, 0, &expire, NULL);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(struct screen *s) {
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) msglen = E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < 5) abAppend(ab, E.statusmsg, msglen);
+    if (msglen && time(NULL) - E.statusmsg_time < STATUS_TIMEOUT) screenPut(s, E.screenrows + 1, 0, E.statusmsg, msglen, 0);
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
     if (at < 0 || row->size < at) at = row->size;
-    row->chars = (char*)realloc(row->chars, row->size + 2);
+    editorRowReserve(row, row->size + 1);
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->size++;
     row->chars[at] = c;
+    editorRowTabsEdit(row, at, 0, 1);
     editorUpdateRow(row);
+    E.dirty++;
 }
 
 void editorInsertChar(int c) {
     char *blank = (char*)"";
     if (E.cy == E.numrows) editorInsertRow(E.numrows, blank, 0);
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
     E.cx++;
 }
 
 void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    size_t size = editorRowBlockSize(row);
+    if (row->rcap) {
+        E.cache.bytes -= size - row->cap;
+        editorCacheUnlink(row);
+    }
+    if (row->frozen && E.save.active) E.save.retired.push_back(std::make_pair(row->block, size));
+    else poolFree(&E.pool, row->block, size);
 }
 
 void editorDelRow(int at) {
     if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
+    rownode *l, *node, *r;
+    rowTreeSplit(E.rows, at, &l, &r);
+    rowTreeSplit(r, 1, &node, &r);
+    E.rows = rowTreeMerge(l, r);
+    E.map_intact = 0;
+    if (E.rows) E.rows->parent = NULL;
     E.numrows--;
+    editorMatchShift(at, -1);
+
+    editorSyntaxInvalidate(at);
+    editorFreeRow(&node->row);
+    editorRowTabsFree(&node->row);
+    rowNodeFree(node);
     E.dirty++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = (char*)realloc(row->chars, row->size + len + 1);
+    editorRowReserve(row, row->size + len);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
+    editorRowTabsEdit(row, row->size - len, 0, len);
     editorUpdateRow(row);
     E.dirty++;
 }
 
+void editorInsertText(const char *s, size_t len) { // a paste: one bulk row insert rather than a key at a time
+    if (len == 0) return;
+    if (E.cy == E.numrows) editorInsertRow(E.numrows, (char*)"", 0);
+    std::vector<const char*> lines;
+    std::vector<size_t> lens;
+    const char *p = s, *end = s + len;
+    while (1) { // lines end at \r\n, \r or \n
+        const char *q = p;
+        while (q < end && *q != '\r' && *q != '\n') q++;
+        lines.push_back(p);
+        lens.push_back(q - p);
+        if (q == end) break;
+        p = q + 1 + (*q == '\r' && q + 1 < end && q[1] == '\n');
+    }
+
+    erow *row = editorRowAt(E.cy);
+    if (lines.size() == 1) {
+        editorRowReserve(row, row->size + len);
+        memmove(&row->chars[E.cx + len], &row->chars[E.cx], row->size - E.cx + 1);
+        memcpy(&row->chars[E.cx], s, len);
+        row->size += len;
+        editorRowTabsEdit(row, E.cx, 0, len);
+        editorUpdateRow(row);
+        E.cx += len;
+        E.dirty++;
+        return;
+    }
+
+    // the rest of the cursor row moves to the end of the last line
+    int n = lines.size();
+    std::string last(lines[n - 1], lens[n - 1]);
+    last.append(row->chars + E.cx, row->size - E.cx);
+    editorRowReserve(row, row->size);
+    editorRowTabsEdit(row, E.cx, row->size - E.cx, 0);
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+    editorRowAppendString(row, (char*)lines[0], lens[0]);
+    E.cx = lens[n - 1];
+    lines[n - 1] = last.data();
+    lens[n - 1] = last.size();
+    editorInsertRows(E.cy + 1, &lines[1], &lens[1], n - 1);
+    E.cy += n - 1;
+}
+
 void editorInsertNewLine() {
     char *blank = (char*)"";
-    if (E.row == 0) editorInsertRow(E.cy, blank, 0);
+    if (E.cy == E.numrows) editorInsertRow(E.cy, blank, 0);
     else {
-        erow *row = &E.row[E.cy];
+        erow *row = editorRowAt(E.cy);
         editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
+        editorRowReserve(row, row->size);
+        editorRowTabsEdit(row, E.cx, row->size - E.cx, 0);
         row->size = E.cx;
         row->chars[row->size] = '\0';
         editorUpdateRow(row);
@@ -1036,25 +3335,244 @@ void editorInsertNewLine() {
     E.cx = 0;
 }
 
-char* editorRowToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++) totlen += E.row[j].size + 1;
-    *buflen = totlen;
+erow *editorRowAt(int at) { // O(log n) lookup by position
+    if (at < 0 || at >= E.numrows) return NULL;
+    rownode *n = E.rows;
+    while (n) {
+        int lcount = n->left ? n->left->count : 0;
+        if (at < lcount) {
+            n = n->left;
+        } else if (at == lcount) {
+            return &n->row;
+        } else {
+            at -= lcount + 1;
+            n = n->right;
+        }
+    }
+    return NULL;
+}
 
-    char *buf = (char*)malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+int editorRowIndex(erow *row) { // O(log n) position, from the subtree counts on the way up
+    rownode *n = (rownode*)row;
+    int at = n->left ? n->left->count : 0;
+    for (; n->parent; n = n->parent) {
+        if (n->parent->right == n) at += (n->parent->left ? n->parent->left->count : 0) + 1;
     }
+    return at;
+}
+
+erow *editorRowNext(erow *row) { // in-order successor, amortized O(1)
+    rownode *n = (rownode*)row;
+    if (n->right) {
+        n = n->right;
+        while (n->left) n = n->left;
+        return &n->row;
+    }
+    while (n->parent && n->parent->right == n) n = n->parent;
+    return n->parent ? &n->parent->row : NULL;
+}
+
+erow *editorRowPrev(erow *row) { // in-order predecessor, amortized O(1)
+    rownode *n = (rownode*)row;
+    if (n->left) {
+        n = n->left;
+        while (n->right) n = n->right;
+        return &n->row;
+    }
+    while (n->parent && n->parent->left == n) n = n->parent;
+    return n->parent ? &n->parent->row : NULL;
+}
+
+void rowTreeUpdate(rownode *n) {
+    n->count = 1;
+    if (n->left) {
+        n->count += n->left->count;
+        n->left->parent = n;
+    }
+    if (n->right) {
+        n->count += n->right->count;
+        n->right->parent = n;
+    }
+}
+
+rownode *rowTreeMerge(rownode *a, rownode *b) { // all rows of a come before b
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->right = rowTreeMerge(a->right, b);
+        rowTreeUpdate(a);
+        return a;
+    }
+    b->left = rowTreeMerge(a, b->left);
+    rowTreeUpdate(b);
+    return b;
+}
+
+void rowTreeSplit(rownode *t, int k, rownode **l, rownode **r) { // first k rows go to l
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    int lcount = t->left ? t->left->count : 0;
+    if (lcount < k) {
+        rowTreeSplit(t->right, k - lcount - 1, &t->right, r);
+        rowTreeUpdate(t);
+        *l = t;
+    } else {
+        rowTreeSplit(t->left, k, l, &t->left);
+        rowTreeUpdate(t);
+        *r = t;
+    }
+    t->parent = NULL;
+}
+
+rownode *rowTreeBuild(rownode **nodes, int n) { // O(n) treap over rows already in order
+    if (n == 0) return NULL;
+    rownode **stack = (rownode**)malloc(sizeof(rownode*) * n);
+    int sp = 0;
+    for (int i = 0; i < n; i++) {
+        rownode *last = NULL;
+        while (sp && stack[sp - 1]->prio < nodes[i]->prio) {
+            last = stack[--sp];
+            rowTreeUpdate(last);
+        }
+        nodes[i]->left = last;
+        nodes[i]->right = NULL;
+        nodes[i]->parent = NULL;
+        if (sp) stack[sp - 1]->right = nodes[i];
+        stack[sp++] = nodes[i];
+    }
+    rownode *root = sp ? stack[0] : NULL;
+    while (sp) rowTreeUpdate(stack[--sp]);
+    free(stack);
+    return root;
+}
+
+unsigned int rowTreeRandom() { // xorshift32, a sequence per thread
+    static std::atomic<unsigned int> seed(2463534242u);
+    static thread_local unsigned int state = seed.fetch_add(0x9e3779b9u) | 1;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+rownode *rowNodeAlloc() { // a deleted row's node if there is one
+    rownode *n = E.free_nodes;
+    if (!n) return (rownode*)malloc(sizeof(rownode));
+    E.free_nodes = n->right;
+    return n;
+}
+
+void rowNodeFree(rownode *n) { // loaded rows share blocks, so nodes are kept for reuse
+    n->right = E.free_nodes;
+    E.free_nodes = n;
+}
+
+size_t editorRowBlockSize(erow *row) {
+    return row->cap + (row->tabs ? row->rcap : 0) + row->rcap;
+}
 
-    return buf;
+// pool: row blocks come in size classes four to a power of two, so a block
+// wastes at most a quarter of itself. Each class keeps a free list; new
+// blocks are carved off 1 MB slabs. Rows of a file are many and small, and
+// their sizes change as they are edited: slabs keep them from scattering
+// over the heap, and go back all at once when the rows are dropped.
+int poolClass(size_t n) { // smallest class that holds n bytes, POOL_CLASSES if none
+    if (n <= 16) return 0;
+    int e = 63 - __builtin_clzll(n - 1);
+    int c = (e - 4) * 4 + (int)(((n - 1) >> (e - 2)) & 3) + 1;
+    return c < POOL_CLASSES ? c : POOL_CLASSES;
 }
 
-void editorSave() {
+size_t poolClassSize(int c) {
+    if (c == 0) return 16;
+    return (size_t)(5 + (c - 1) % 4) << ((c - 1) / 4 + 2);
+}
+
+char *poolAlloc(struct rowPool *pl, size_t n) {
+    int c = poolClass(n);
+    if (c == POOL_CLASSES) {
+        pl->held += n;
+        pl->live += n;
+        pl->blocks++;
+        return (char*)malloc(n);
+    }
+    size_t size = poolClassSize(c);
+    char *p = pl->free[c];
+    if (p) memcpy(&pl->free[c], p, sizeof(char*));
+    else {
+        if (pl->end - pl->at < (ptrdiff_t)size) {
+            pl->at = (char*)malloc(POOL_SLAB);
+            pl->end = pl->at + POOL_SLAB;
+            pl->slabs.push_back(pl->at);
+            pl->held += POOL_SLAB;
+        }
+        p = pl->at;
+        pl->at += size;
+    }
+    pl->live += size;
+    pl->blocks++;
+    return p;
+}
+
+void poolFree(struct rowPool *pl, char *p, size_t n) { // n as passed to poolAlloc
+    if (!p) return;
+    int c = poolClass(n);
+    pl->blocks--;
+    if (c == POOL_CLASSES) {
+        pl->held -= n;
+        pl->live -= n;
+        free(p);
+        return;
+    }
+    memcpy(p, &pl->free[c], sizeof(char*));
+    pl->free[c] = p;
+    pl->live -= poolClassSize(c);
+}
+
+char *poolShrink(struct rowPool *pl, char *p, size_t n, size_t m) { // keep the first m bytes of a block allocated for n
+    int c = poolClass(n), k = poolClass(m);
+    if (c == POOL_CLASSES && k == POOL_CLASSES) {
+        pl->held -= n - m;
+        pl->live -= n - m;
+        return (char*)realloc(p, m);
+    }
+    if (c == POOL_CLASSES) { // too big for a class before, not now
+        char *q = poolAlloc(pl, m);
+        memcpy(q, p, m);
+        poolFree(pl, p, n);
+        return q;
+    }
+    // the tail goes to the free lists in the biggest blocks that fit, a few bytes may be lost
+    size_t keep = poolClassSize(k), left = poolClassSize(c) - keep;
+    char *tail = p + keep;
+    pl->live -= left;
+    while (left >= 16) {
+        int j = poolClass(left);
+        if (poolClassSize(j) > left) j--;
+        memcpy(tail, &pl->free[j], sizeof(char*));
+        pl->free[j] = tail;
+        tail += poolClassSize(j);
+        left -= poolClassSize(j);
+    }
+    return p;
+}
+
+void poolRelease(struct rowPool *pl) { // drop every slab; no block may be in use
+    for (size_t i = 0; i < pl->slabs.size(); i++) free(pl->slabs[i]);
+    std::vector<char*>().swap(pl->slabs);
+    memset(pl->free, 0, sizeof(pl->free));
+    pl->at = pl->end = NULL;
+    pl->held = pl->live = 0;
+}
+
+void editorSave() { // snapshot the rows and write them on a background thread
+    struct saver *sv = &E.save;
+    if (sv->active) {
+        editorSetStatusMessage("Save in progress");
+        return;
+    }
     if (E.filename == NULL) {
         char *msg = (char*)"Save as: %s";
         E.filename = editorPrompt(msg, NULL);
@@ -1064,26 +3582,432 @@ void editorSave() {
         }
         editorSelectSyntaxHighlight();
     }
+    editorEnsureAllRows();
+
+    // write a temp file next to the real one and rename it over: a crash
+    // leaves either the old file or the new one, and the old inode stays
+    // alive under the mapping the rows point into
+    char *path = realpath(E.filename, NULL);
+    sv->target = path ? path : E.filename;
+    free(path);
+    sv->tmp = sv->target + ".XXXXXX";
+    mode_t mode = umask(0);
+    umask(mode);
+    sv->mode = 0666 & ~mode;
+    struct stat st;
+    if (stat(sv->target.c_str(), &st) == 0) sv->mode = st.st_mode & 07777;
+
+    sv->segs.clear();
+    sv->total = 0;
+    sv->large = E.large.on;
+    if (sv->large) { // the snapshot is the overlay: the writer reads the rest from the file
+        editorLargeCommit();
+        sv->overlay = E.large.overlay;
+        sv->in_fd = E.large.fd;
+        sv->in_size = E.large.size;
+        sv->total = editorLargeSavedSize();
+    }
 
-    int len;
-    char *buf = editorRowToString(&len);
+    // the snapshot points at the rows' own bytes: owned rows are frozen, and
+    // editorRowReserve copies a frozen row before it changes
+    static const char newline = '\n';
+    for (erow *row = editorRowAt(0); row && !sv->large; row = editorRowNext(row)) {
+        if (!row->mapped) row->frozen = 1;
+        editorSaveAppend(row->chars, row->size);
+        char *end = row->chars + row->size;
+        if (row->mapped && end < E.map + E.mapsize && *end == '\n') editorSaveAppend(end, 1); // runs of mapped lines merge into one segment
+        else editorSaveAppend(&newline, 1);
+    }
+    sv->rows = E.numrows;
+    sv->dirty = E.dirty;
+    sv->written = 0;
+    sv->err = 0;
+    sv->done = false;
+    sv->active = 1;
+    clock_gettime(CLOCK_MONOTONIC, &sv->start);
+    sv->thread = std::thread(editorSaveThread);
+}
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644); // read/write mode or create file
+void editorSaveAppend(const char *p, size_t n) { // add bytes to the snapshot
+    if (n == 0) return;
+    std::vector<struct iovec> &segs = E.save.segs;
+    if (!segs.empty() && (char*)segs.back().iov_base + segs.back().iov_len == p) {
+        segs.back().iov_len += n;
+    } else {
+        struct iovec v = { (void*)p, n };
+        segs.push_back(v);
+    }
+    E.save.total += n;
+}
+
+void editorSaveThread() {
+    struct saver *sv = &E.save;
+    int fd = mkstemp(&sv->tmp[0]);
     if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%s %dL, %dB written", E.filename, E.numrows, len);
+        if (fchmod(fd, sv->mode) != -1 && editorSaveWrite(fd) != -1 && fsync(fd) != -1) {
+            if (close(fd) != -1 && rename(sv->tmp.c_str(), sv->target.c_str()) != -1) {
+                std::string dir = sv->target.substr(0, sv->target.rfind('/') + 1);
+                int dfd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+                if (dfd != -1) {
+                    fsync(dfd); // the rename itself
+                    close(dfd);
+                }
+                sv->done = true;
+                editorWake();
                 return;
             }
+            fd = -1;
         }
-        close(fd);
+        sv->err = errno;
+        if (fd != -1) close(fd);
+        unlink(sv->tmp.c_str());
+    } else {
+        sv->err = errno;
+    }
+    sv->done = true;
+    editorWake();
+}
+
+int editorSaveWrite(int fd) { // the snapshot, IOV_MAX segments per call
+    struct saver *sv = &E.save;
+    if (sv->large) return editorSaveWriteLarge(fd);
+    size_t at = 0;
+    int percent = 0;
+    while (at < sv->segs.size()) {
+        struct iovec *v = &sv->segs[at];
+        int n = std::min(sv->segs.size() - at, (size_t)IOV_MAX);
+        ssize_t w = writev(fd, v, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        sv->written += w;
+        // drop what went out, resume inside a partly written segment
+        while (at < sv->segs.size() && (size_t)w >= sv->segs[at].iov_len) w -= sv->segs[at++].iov_len;
+        if (w > 0) {
+            sv->segs[at].iov_base = (char*)sv->segs[at].iov_base + w;
+            sv->segs[at].iov_len -= w;
+        }
+        editorSaveProgress(&percent);
+    }
+    return 0;
+}
+
+int editorSaveWriteLarge(int fd) { // the original file with the overlay spliced in
+    struct saver *sv = &E.save;
+    size_t pos = 0;
+    int percent = 0;
+    std::map<size_t, overlayEntry>::iterator it = sv->overlay.begin();
+    while (1) {
+        size_t to = (it == sv->overlay.end()) ? sv->in_size : it->first;
+        if (editorSaveCopy(fd, pos, to - pos) == -1) return -1;
+        if (it == sv->overlay.end()) return 0;
+        const std::string &text = it->second.text;
+        for (size_t done = 0; done < text.size();) {
+            ssize_t w = write(fd, text.data() + done, text.size() - done);
+            if (w == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            done += w;
+            sv->written += w;
+        }
+        editorSaveProgress(&percent);
+        pos = it->first + it->second.len;
+        ++it;
+    }
+}
+
+int editorSaveCopy(int fd, size_t off, size_t len) { // original bytes, copied in the kernel where it can
+    struct saver *sv = &E.save;
+    loff_t in = off;
+    int percent = 0;
+    while (len > 0) {
+        ssize_t n = copy_file_range(sv->in_fd, &in, fd, NULL, std::min(len, (size_t)1 << 30), 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len -= n;
+        sv->written += n;
+        editorSaveProgress(&percent);
     }
+    std::vector<char> buf(len ? (1 << 20) : 0); // not supported here: through a buffer
+    while (len > 0) {
+        ssize_t n = pread(sv->in_fd, buf.data(), std::min(len, buf.size()), in);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (writeAll(fd, buf.data(), n) != n) return -1;
+        in += n;
+        len -= n;
+        sv->written += n;
+        editorSaveProgress(&percent);
+    }
+    return 0;
+}
+
+void editorSaveProgress(int *percent) { // wake the UI when the percentage in the status bar moves
+    struct saver *sv = &E.save;
+    int now = sv->total ? sv->written * 100 / sv->total : 100;
+    if (now == *percent) return;
+    *percent = now;
+    editorWake();
+}
 
-    free(buf);
-    editorSetStatusMessage("Can't save. I/O Error: %s" , strerror(errno));
+void editorSaveFinish() { // once the writer is done: report, and release the snapshot
+    struct saver *sv = &E.save;
+    if (!sv->active || !sv->done) return;
+    sv->thread.join();
+    sv->active = 0;
+    for (size_t i = 0; i < sv->retired.size(); i++) poolFree(&E.pool, sv->retired[i].first, sv->retired[i].second);
+    std::vector<std::pair<char*, size_t> >().swap(sv->retired);
+    std::vector<struct iovec>().swap(sv->segs);
+    sv->overlay.clear();
+    if (sv->err) {
+        editorSetStatusMessage("Can't save. I/O Error: %s" , strerror(sv->err));
+        return;
+    }
+
+    E.dirty -= sv->dirty; // edits made while writing are still unsaved
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (now.tv_sec - sv->start.tv_sec) + (now.tv_nsec - sv->start.tv_nsec) / 1e9;
+    if (secs < 1e-6) secs = 1e-6;
+    if (sv->large) editorSetStatusMessage("%s %lldB written in %.2fs (%.1f MB/s)", E.filename, sv->total, secs, sv->total / secs / 1e6);
+    else editorSetStatusMessage("%s %dL, %lldB written in %.2fs (%.1f MB/s)", E.filename, sv->rows, sv->total, secs, sv->total / secs / 1e6);
+}
+
+// large-file mode: rows exist only for a window of LARGE_SCREENS screens
+// around the cursor, read through a movable read-only view of the file.
+// Edits live in the rows until the window moves, then go to an overlay of
+// replaced line ranges keyed by original offset; saving streams the file
+// with the overlay spliced in
+void editorLargeOpen(int fd, size_t size) {
+    E.large.on = 1;
+    E.large.fd = fd;
+    E.large.size = size;
+    E.large.view = NULL;
+    E.large.view_off = E.large.view_len = 0;
+    E.syntax = NULL; // whole-file lexer state is out of reach
+    editorLargeLoad(0, 0);
+    E.dirty = 0;
+}
+
+const char *editorLargeView(size_t off, size_t len) { // file bytes [off, off + len), mapping a new view if needed
+    if (off + len > E.large.size) len = E.large.size - off;
+    if (E.large.view && off >= E.large.view_off && off + len <= E.large.view_off + E.large.view_len) {
+        return E.large.view + (off - E.large.view_off);
+    }
+    if (E.large.view) munmap(E.large.view, E.large.view_len);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = off / page * page;
+    size_t to = std::min(E.large.size, std::max(off + len, from + LARGE_VIEW));
+    void *view = mmap(NULL, to - from, PROT_READ, MAP_PRIVATE, E.large.fd, from);
+    if (view == MAP_FAILED) die("mmap");
+    E.large.view = (char*)view;
+    E.large.view_off = from;
+    E.large.view_len = to - from;
+    return E.large.view + (off - from);
+}
+
+size_t editorLargeLineEnd(size_t off) { // offset of the '\n' ending the line at off, or the file size
+    size_t len = LARGE_VIEW / 2;
+    while (1) {
+        len = std::min(len, E.large.size - off);
+        const char *p = editorLargeView(off, len);
+        const char *nl = (const char*)memchr(p, '\n', len);
+        if (nl) return off + (nl - p);
+        if (off + len == E.large.size) return E.large.size;
+        len *= 2;
+    }
+}
+
+size_t editorLargeLineStart(size_t end) { // start of the line whose '\n' is at end - 1
+    size_t len = LARGE_VIEW / 2;
+    while (1) {
+        size_t from = (end - 1 > len) ? end - 1 - len : 0;
+        const char *p = editorLargeView(from, end - 1 - from);
+        const char *nl = (const char*)memrchr(p, '\n', end - 1 - from);
+        if (nl) return from + (nl - p) + 1;
+        if (from == 0) return 0;
+        len *= 2;
+    }
+}
+
+void editorLargeLoad(size_t pos, int rows) { // rows for the lines from original offset pos on, at least rows of them
+    struct largeFile *lf = &E.large;
+    int want = std::max(rows, LARGE_SCREENS * (E.screenrows + 2));
+    std::vector<const char*> lines;
+    std::vector<size_t> lens;
+    lf->base.clear();
+    lf->base_off.clear();
+    lf->base_end.clear();
+    std::string text; // overlay text, copied out of the map below
+    size_t p = pos;
+    while ((int)lf->base.size() < want && p < lf->size) {
+        std::map<size_t, overlayEntry>::iterator it = lf->overlay.find(p);
+        if (it != lf->overlay.end()) { // an edited range: its lines in place of the file's
+            const std::string &t = it->second.text;
+            for (size_t at = 0; at < t.size();) {
+                size_t nl = t.find('\n', at);
+                lf->base.push_back(t.substr(at, nl - at));
+                lf->base_off.push_back(p);
+                lf->base_end.push_back(p + it->second.len);
+                at = nl + 1;
+            }
+            p += it->second.len;
+            continue;
+        }
+        size_t end = editorLargeLineEnd(p);
+        size_t len = end - p;
+        const char *s = editorLargeView(p, len);
+        while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r')) len--;
+        lf->base.push_back(std::string(s, len));
+        lf->base_off.push_back(p);
+        lf->base_end.push_back(end < lf->size ? end + 1 : end);
+        p = lf->base_end.back();
+    }
+    lf->start = pos;
+    lf->end = p;
+
+    // swap the rows wholesale; loading a window is not an edit
+    int dirty = E.dirty;
+    editorRowsClear();
+    for (size_t i = 0; i < lf->base.size(); i++) {
+        lines.push_back(lf->base[i].data());
+        lens.push_back(lf->base[i].size());
+    }
+    editorInsertRows(0, lines.data(), lens.data(), lines.size());
+    lf->edits = E.hl.edits;
+    E.dirty = dirty;
+    if (!E.match.sr.needle.empty()) {
+        std::string needle = E.match.sr.needle;
+        editorMatchQuery(needle.c_str());
+    }
+}
+
+void editorLargeCommit() { // move the window's edits into the overlay
+    struct largeFile *lf = &E.large;
+    if (E.hl.edits == lf->edits) return;
+    std::vector<std::string> rows;
+    for (erow *row = editorRowAt(0); row; row = editorRowNext(row)) rows.push_back(std::string(row->chars, row->size));
+
+    // the changed lines: what is left between the unchanged head and tail
+    int b = lf->base.size(), r = rows.size();
+    int head = 0, tail = 0;
+    while (head < b && head < r && lf->base[head] == rows[head]) head++;
+    while (tail < b - head && tail < r - head && lf->base[b - 1 - tail] == rows[r - 1 - tail]) tail++;
+    if (head == b && head == r) return;
+    if (head + tail == b) { // pure insertion: take a neighbouring line along, entries never cover nothing
+        if (head > 0) head--;
+        else tail--;
+    }
+    // entries from earlier edits are replaced whole
+    while (head > 0 && lf->base_off[head - 1] == lf->base_off[head]) head--;
+    while (tail > 0 && lf->base_off[b - tail] == lf->base_off[b - tail - 1]) tail--;
+
+    size_t off = lf->base_off[head], end = lf->base_end[b - tail - 1];
+    overlayEntry entry;
+    entry.len = end - off;
+    for (int i = head; i < r - tail; i++) entry.text += rows[i] + '\n';
+    lf->overlay.erase(lf->overlay.lower_bound(off), lf->overlay.lower_bound(end));
+    lf->overlay[off] = entry;
+
+    // the rows are now what the window holds of the file
+    lf->base_off.erase(lf->base_off.begin() + head, lf->base_off.begin() + b - tail);
+    lf->base_off.insert(lf->base_off.begin() + head, r - tail - head, off);
+    lf->base_end.erase(lf->base_end.begin() + head, lf->base_end.begin() + b - tail);
+    lf->base_end.insert(lf->base_end.begin() + head, r - tail - head, end);
+    lf->base.swap(rows);
+    lf->edits = E.hl.edits;
+}
+
+size_t editorLargeSplit(size_t off, int j) { // cut the overlay entry at off so that its line j starts one
+    // any cut of the lines is right as long as each part keeps some of the
+    // file's; returns where the second part starts, off if the entry
+    // replaces a single line and cannot be cut
+    struct largeFile *lf = &E.large;
+    std::map<size_t, overlayEntry>::iterator it = lf->overlay.find(off);
+    if (j <= 0 || it == lf->overlay.end()) return off;
+    size_t end = off + it->second.len;
+    size_t p = off;
+    for (int i = 0; i < j; i++) { // the file's lines stay paired with the new ones where they can
+        size_t next = editorLargeLineEnd(p) + 1;
+        if (next >= end) break;
+        p = next;
+    }
+    if (p == off) return off;
+
+    std::string &t = it->second.text;
+    size_t cut = 0;
+    for (int i = 0; i < j; i++) cut = t.find('\n', cut) + 1;
+    overlayEntry rest;
+    rest.len = end - p;
+    rest.text = t.substr(cut);
+    t.resize(cut);
+    it->second.len = p - off;
+    lf->overlay[p] = rest;
+    return p;
+}
+
+void editorLargeFollow() { // move the window along once the cursor nears either end of it
+    struct largeFile *lf = &E.large;
+    if (!lf->on) return;
+    int margin = 2 * E.screenrows;
+    int down = E.cy >= E.numrows - margin && lf->end < lf->size;
+    int up = E.cy < margin && lf->start > 0;
+    if (!down && !up) return;
+
+    editorLargeCommit(); // base is in step with the rows and the overlay
+    int half = LARGE_SCREENS * (E.screenrows + 2) / 2;
+    int shift;
+    size_t pos;
+    if (down) { // start at the line half a window above the cursor
+        int k = std::max(0, E.cy - half);
+        int j = 0;
+        while (k > 0 && lf->base_off[k - 1] == lf->base_off[k]) k--, j++; // inside an edited range: cut it there
+        pos = editorLargeSplit(lf->base_off[k], j);
+        if (pos != lf->base_off[k]) k += j;
+        shift = -k;
+    } else { // start half a window above the window
+        pos = lf->start;
+        shift = 0;
+        while (shift < half && pos > 0) {
+            std::map<size_t, overlayEntry>::iterator it = lf->overlay.lower_bound(pos);
+            if (it != lf->overlay.begin() && (--it)->first + it->second.len == pos) {
+                size_t at = it->first;
+                int n = std::count(it->second.text.begin(), it->second.text.end(), '\n');
+                int j = n - (half - shift); // take only the lines still wanted, if it can be cut
+                pos = editorLargeSplit(at, j);
+                shift += pos != at ? n - j : n;
+            } else {
+                pos = editorLargeLineStart(pos);
+                shift++;
+            }
+        }
+    }
+    editorLargeLoad(pos, E.cy + shift + half); // the cursor's line keeps its place in the window
+    E.cy += shift;
+    E.rowoff = std::max(0, E.rowoff + shift);
+}
+
+size_t editorLargeSavedSize() { // bytes the file will have with the overlay spliced in
+    size_t size = E.large.size;
+    std::map<size_t, overlayEntry>::iterator it;
+    for (it = E.large.overlay.begin(); it != E.large.overlay.end(); ++it) size += it->second.text.size() - it->second.len;
+    return size;
+}
+
+void editorRowsClear() { // free every row
+    std::vector<rownode*> nodes;
+    for (erow *row = editorRowAt(0); row; row = editorRowNext(row)) nodes.push_back((rownode*)row);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        editorFreeRow(&nodes[i]->row);
+        editorRowTabsFree(&nodes[i]->row);
+        rowNodeFree(nodes[i]);
+    }
+    E.rows = NULL;
+    E.numrows = 0;
+    if (E.pool.blocks == 0) poolRelease(&E.pool);
+    editorSyntaxInvalidate(0);
 }
 
 int getWindowSize(int *rows, int *cols) {
@@ -1099,6 +4023,21 @@ int getWindowSize(int *rows, int *cols) {
     return 0;
 }
 
+void editorResize() { // SIGWINCH: the new size from the kernel, never a round trip through the terminal
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return; // keep the cached size
+    int rows = ws.ws_row > 2 ? ws.ws_row - 2 : 1;
+    if (rows == E.screenrows && ws.ws_col == E.screencols) return;
+    E.screenrows = rows;
+    E.screencols = ws.ws_col;
+    // only the screen grids depend on the size; rows, renders and hl do not
+    screenResize(&E.screen, E.screenrows + 2, E.screencols);
+    screenResize(&E.frame, E.screenrows + 2, E.screencols);
+    E.screen_valid = 0;
+    E.cursor_y = E.cursor_x = -1;
+    abReserve(&E.out, (E.screenrows + 2) * E.screencols * 4);
+}
+
 int getCursorPosition(int *rows, int *cols) {
     char buf[32];
     unsigned int i = 0;
@@ -1107,6 +4046,8 @@ int getCursorPosition(int *rows, int *cols) {
     if (err != 4) return -1;
 
     while (i < sizeof(buf) - 1) {
+        struct pollfd in = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&in, 1, 1000) != 1) break;
         err = read(STDIN_FILENO, &buf[i], 1);
         if (err != 1) break;
         if (buf[i] == 'R') break;
@@ -1120,15 +4061,91 @@ int getCursorPosition(int *rows, int *cols) {
     return 0;
 }
 
+void screenResize(struct screen *s, int rows, int cols) {
+    s->rows = rows;
+    s->cols = cols;
+    s->chars = (char*)realloc(s->chars, rows * cols);
+    s->attrs = (unsigned char*)realloc(s->attrs, rows * cols);
+    screenClear(s);
+}
+
+void screenClear(struct screen *s) {
+    memset(s->chars, ' ', s->rows * s->cols);
+    memset(s->attrs, 0, s->rows * s->cols);
+}
+
+void screenScroll(struct screen *s, int top, int bottom, int n) { // move rows [top, bottom) up by n (down if negative)
+    int rows = bottom - top;
+    int keep = rows - abs(n);
+    char *chars = &s->chars[top * s->cols];
+    unsigned char *attrs = &s->attrs[top * s->cols];
+    int from = n > 0 ? n : 0, to = n > 0 ? 0 : -n, blank = n > 0 ? keep : 0;
+    memmove(&chars[to * s->cols], &chars[from * s->cols], keep * s->cols);
+    memmove(&attrs[to * s->cols], &attrs[from * s->cols], keep * s->cols);
+    memset(&chars[blank * s->cols], ' ', abs(n) * s->cols);
+    memset(&attrs[blank * s->cols], 0, abs(n) * s->cols);
+}
+
+int screenPut(struct screen *s, int y, int x, const char *text, int len, unsigned char attr) {
+    if (y < 0 || y >= s->rows || x < 0) return x;
+    if (len > s->cols - x) len = s->cols - x;
+    if (len <= 0) return x;
+    memcpy(&s->chars[y * s->cols + x], text, len);
+    memset(&s->attrs[y * s->cols + x], attr, len);
+    return x + len;
+}
+
+void screenAppendAttr(struct abuf *ab, unsigned char from, unsigned char to) { // SGR from one cell attr to another
+    char buf[16];
+    int len;
+    if ((from & ATTR_REVERSE) != (to & ATTR_REVERSE)) {
+        len = snprintf(buf, sizeof(buf), "\x1b[0%s", (to & ATTR_REVERSE) ? ";7" : "");
+        from = 0;
+        abAppend(ab, buf, len);
+        if (to & ~ATTR_REVERSE) {
+            len = snprintf(buf, sizeof(buf), ";%dm", to & ~ATTR_REVERSE);
+        } else {
+            len = snprintf(buf, sizeof(buf), "m");
+        }
+    } else {
+        len = snprintf(buf, sizeof(buf), "\x1b[%dm", (to & ~ATTR_REVERSE) ? (to & ~ATTR_REVERSE) : 39);
+    }
+    abAppend(ab, buf, len);
+}
+
 void abAppend(struct abuf *ab, const char *s, int len) {
-    char *newab = (char*)realloc(ab->b, ab->len + len);
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 4096;
+        while (cap < ab->len + len) cap *= 2;
+        abReserve(ab, cap);
+        if (ab->cap < ab->len + len) return;
+    }
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
+
+void abReserve(struct abuf *ab, int cap) {
+    if (cap <= ab->cap) return;
+    char *newab = (char*)realloc(ab->b, cap);
     if (newab == NULL) return;
-    memcpy(&newab[ab->len], s, len);
     ab->b = newab;
-    ab->len += len;
+    ab->cap = cap;
 }
 
 
 void abFree(struct abuf *ab) {
     free(ab->b);
 }
+
+int writeAll(int fd, const char *buf, int len) { // write everything, across partial writes
+    int done = 0;
+    while (done < len) {
+        int n = write(fd, buf + done, len - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
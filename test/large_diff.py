@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+# Differential check of large-file mode: the same keys, typed into the same
+# file opened normally and with -l 1, must save the same bytes.
+#
+#   python3 test/large_diff.py [./moec] [keys per seed]
+
+import os, pty, random, select, shutil, struct, sys, tempfile, time, fcntl, termios
+
+MOEC = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else './moec')
+KEYS = int(sys.argv[2]) if len(sys.argv) > 2 else 2500
+SEEDS = [1, 2, 3]
+
+UP, DOWN, RIGHT, LEFT = b'\x1b[A', b'\x1b[B', b'\x1b[C', b'\x1b[D'
+PAGE_UP, PAGE_DOWN = b'\x1b[5~', b'\x1b[6~'
+ENTER, BACKSPACE, SAVE, QUIT = b'\r', b'\x7f', b'\x13', b'\x11'
+
+def make_file(path):
+    r = random.Random(0)
+    with open(path, 'w') as f:
+        size = i = 0
+        while size < 1900000:
+            line = '%06d %s\n' % (i, ''.join(r.choice('abcdefgh ') for _ in range(r.randint(0, 70))))
+            f.write(line)
+            size += len(line)
+            i += 1
+
+def make_keys(seed):
+    # runs heading down and up, so the window slides both ways, with bursts
+    # of Enter that turn one line of the file into many rows, and saves
+    r = random.Random(seed)
+    keys = [UP, DOWN, RIGHT, LEFT, b'Q', ENTER, BACKSPACE, PAGE_UP, PAGE_DOWN]
+    down = [3, 6, 2, 2, 3, 1, 2, 0, 1]
+    up = [7, 2, 2, 2, 3, 1, 2, 1, 0]
+    out = []
+    while len(out) < KEYS:
+        p = r.random()
+        if p < 0.1: out += [ENTER] * r.randint(50, 200)
+        elif p < 0.15: out += [SAVE]
+        elif p < 0.6: out += r.choices(keys, down, k=300)
+        else: out += r.choices(keys, up, k=300)
+    return out[:KEYS]
+
+def drain(fd, timeout=0.05):
+    # read the screen updates until the editor goes quiet
+    while True:
+        r, _, _ = select.select([fd], [], [], timeout)
+        if not r: return
+        try:
+            if not os.read(fd, 65536): return
+        except OSError: return
+
+def save(fd, path):
+    # a save renames a new file over the old one once it is all written
+    inode = os.stat(path).st_ino
+    os.write(fd, SAVE)
+    end = time.time() + 30
+    while os.stat(path).st_ino == inode:
+        if time.time() > end: raise RuntimeError('save did not finish')
+        drain(fd)
+
+def edit(args, path, keys):
+    pid, fd = pty.fork()
+    if pid == 0:
+        os.environ['TERM'] = 'xterm'
+        os.execv(MOEC, [MOEC] + args + [path])
+    fcntl.ioctl(fd, termios.TIOCSWINSZ, struct.pack('HHHH', 24, 80, 0, 0))
+    drain(fd, 0.5)
+    run = []
+    for k in keys + [SAVE]:
+        if k == SAVE or len(run) == 40:
+            os.write(fd, b''.join(run))
+            drain(fd)
+            run = []
+        if k == SAVE: save(fd, path)
+        else: run.append(k)
+    os.write(fd, QUIT)
+    drain(fd, 2)
+    os.waitpid(pid, 0)
+    os.close(fd)
+    with open(path, 'rb') as f: return f.read()
+
+def main():
+    tmp = tempfile.mkdtemp()
+    try:
+        src = os.path.join(tmp, 'src.txt')
+        make_file(src)
+        failed = 0
+        for seed in SEEDS:
+            keys = make_keys(seed)
+            saved = []
+            for args in ([], ['-l', '1']):
+                path = os.path.join(tmp, 'edit.txt')
+                shutil.copy(src, path)
+                saved.append(edit(args, path, keys))
+            if saved[0] == saved[1]:
+                print('seed %d: ok' % seed)
+                continue
+            failed += 1
+            a, b = saved[0].split(b'\n'), saved[1].split(b'\n')
+            at = next((i for i in range(min(len(a), len(b))) if a[i] != b[i]), min(len(a), len(b)))
+            print('seed %d: FAILED, first difference at line %d' % (seed, at + 1))
+        return 1 if failed else 0
+    finally:
+        shutil.rmtree(tmp)
+
+if __name__ == '__main__':
+    sys.exit(main())
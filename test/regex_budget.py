@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# Nested counts multiply: ((a{255}){255}){255} would take millions of NFA
+# nodes. The search prompt must reject it as malformed and stay responsive,
+# while patterns inside the budget still match.
+#
+#   python3 test/regex_budget.py [./moec]
+
+import os, pty, select, shutil, struct, sys, tempfile, time, fcntl, termios
+
+MOEC = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else './moec')
+DEADLINE = 5 # seconds the prompt may take to show the whole pattern
+
+FIND, REGEX, ESC, QUIT = b'\x06', b'\x12', b'\x1b', b'\x11'
+
+def read_until(fd, out, want, timeout):
+    # collect screen updates until want shows up; False on timeout
+    end = time.time() + timeout
+    while want not in out:
+        left = end - time.time()
+        if left <= 0: return False
+        r, _, _ = select.select([fd], [], [], left)
+        if not r: continue
+        try: data = os.read(fd, 65536)
+        except OSError: return False
+        if not data: return False
+        out.extend(data)
+    return True
+
+def search(path, pattern, want):
+    # type pattern at the regex prompt; True if want is on screen in time
+    pid, fd = pty.fork()
+    if pid == 0:
+        os.environ['TERM'] = 'xterm'
+        os.execv(MOEC, [MOEC, path])
+    fcntl.ioctl(fd, termios.TIOCSWINSZ, struct.pack('HHHH', 24, 80, 0, 0))
+    out = bytearray()
+    read_until(fd, out, b'lines', 2)
+    os.write(fd, FIND + REGEX + pattern)
+    ok = read_until(fd, out, want, DEADLINE)
+    os.kill(pid, 9)
+    os.waitpid(pid, 0)
+    os.close(fd)
+    return ok
+
+def main():
+    tmp = tempfile.mkdtemp()
+    try:
+        path = os.path.join(tmp, 'a.txt')
+        with open(path, 'w') as f: f.write('x' * 10 + 'a' * 300 + '\n')
+        cases = [
+            (b'((a{255}){255}){255}', b'Regex: ((a{255}){255}){255} '),
+            (b'(a{10}){20}', b'match 1 of 1'),
+        ]
+        failed = 0
+        for pattern, want in cases:
+            if search(path, pattern, want):
+                print('%s: ok' % pattern.decode())
+            else:
+                failed += 1
+                print('%s: FAILED, no %r within %d s' % (pattern.decode(), want.decode(), DEADLINE))
+        return 1 if failed else 0
+    finally:
+        shutil.rmtree(tmp)
+
+if __name__ == '__main__':
+    sys.exit(main())